@@ -57,6 +57,9 @@ enum {
     FUSE_MOPT_INIT_TIMEOUT        = 1ULL << 11,
     FUSE_MOPT_IOSIZE              = 1ULL << 12,
     FUSE_MOPT_JAIL_SYMLINKS       = 1ULL << 13,
+    FUSE_MOPT_SPIN_WAIT           = 1ULL << 14,
+    FUSE_MOPT_LOCAL_LOCKS         = 1ULL << 15,
+    FUSE_MOPT_WRITEBACK_CACHE     = 1ULL << 16, // implies nosyncwrites once the daemon agrees
     FUSE_MOPT_NO_APPLEDOUBLE      = 1ULL << 17,
     FUSE_MOPT_NO_APPLEXATTR       = 1ULL << 18,
     FUSE_MOPT_NO_ATTRCACHE        = 1ULL << 19,
@@ -33,10 +33,55 @@
 #define FUSE4X_DEVICE_BASENAME            "fuse4x"
 
 /*
- * This is the number of /dev/fuse4x<n> nodes we will create. <n> goes from
- * 0 to (FUSE_NDEVICES - 1).
+ * This is the maximum number of /dev/fuse4x<n> nodes. <n> goes from 0 to
+ * (FUSE4X_NDEVICES - 1). The nodes are created on demand, a batch of
+ * FUSE4X_DEVICE_BATCH at a time: the first batch at load time and the next
+ * one as soon as a node of the last batch gets opened, so there is always a
+ * spare node to open.
  */
-#define FUSE4X_NDEVICES                   24
+#define FUSE4X_NDEVICES                   1024
+#define FUSE4X_DEVICE_BATCH               32
+
+/*
+ * A daemon can serve one mount over several file descriptors ("channels").
+ * To add a channel it opens a spare /dev/fuse4x<m> and issues FUSEDEVIOCCLONE
+ * on it, passing the unit number of the device the mount was set up on.
+ * Requests are spread over the channels and a reply can be written back on
+ * any of them.
+ */
+#define FUSE4X_MAX_CHANNELS               8
+
+#define FUSEDEVIOCCLONE                   _IOW('F', 1, uint32_t)
+
+/*
+ * Requests of a channel are queued per originating process, hashed by pid
+ * into FUSE4X_FAIR_FLOWS flows, and handed to the daemon in deficit round
+ * robin order. A flow with weight w gets w times the share of a flow with
+ * weight 1 (the default). FUSEDEVIOCSETWEIGHT sets the weight of the flow
+ * of a process for the whole mount, FUSEDEVIOCGETFLOWS reads the counters
+ * of the mount's flows.
+ */
+#define FUSE4X_FAIR_FLOWS                 32
+#define FUSE4X_FAIR_MAX_WEIGHT            64
+
+struct fuse_flow_weight {
+    int32_t  pid;
+    uint32_t weight;
+};
+
+struct fuse_flow_stats {
+    int32_t  pid;    /* last process that queued a request on the flow */
+    uint32_t weight;
+    uint32_t queued; /* requests waiting to be read by the daemon */
+    uint32_t served; /* requests read by the daemon so far */
+};
+
+struct fuse_flows {
+    struct fuse_flow_stats flows[FUSE4X_FAIR_FLOWS];
+};
+
+#define FUSEDEVIOCSETWEIGHT               _IOW('F', 2, struct fuse_flow_weight)
+#define FUSEDEVIOCGETFLOWS                _IOR('F', 3, struct fuse_flows)
 
 /*
  * This is the default block size of the virtual storage devices that are
@@ -93,6 +138,59 @@
 
 #define FUSE_REASONABLE_XATTRSIZE          FUSE_MIN_USERKERNEL_BUFSIZE
 
+/*
+ * Attribute prefetch: once this many distinct children of a directory have
+ * missed the attribute cache in a row, GETATTRs for up to "window" of their
+ * following siblings are sent ahead of time. A window of 0 turns it off.
+ */
+#define FUSE_DEFAULT_ATTR_PREFETCH_TRIGGER 3
+#define FUSE_DEFAULT_ATTR_PREFETCH_WINDOW  16
+#define FUSE_MAX_ATTR_PREFETCH_WINDOW      64
+
+/*
+ * Readdir cache: upper bound on the FUSE_READDIR answers kept per directory.
+ * 0 turns the cache off.
+ */
+#define FUSE_DEFAULT_DIRCACHE_MAXSIZE      (1024 * 1024)
+
+/*
+ * Extended attribute cache: largest value (and largest listxattr answer)
+ * kept per vnode. 0 turns the cache off.
+ */
+#define FUSE_DEFAULT_XATTRCACHE_MAXSIZE    4096
+
+/*
+ * Seconds a FUSE_STATFS answer is reused for, unless the daemon says
+ * otherwise in fuse_kstatfs.valid. 0 turns the cache off.
+ */
+#define FUSE_DEFAULT_STATFS_TTL            2
+
+/*
+ * Longest a requester polls for an answer before going to sleep, in
+ * microseconds. Only used on mounts with the spinwait option.
+ */
+#define FUSE_DEFAULT_SPIN_WAIT_MAX         50
+
+/*
+ * Seconds a requester over the max_tickets or max_bulk_tickets budget
+ * sleeps without seeing any request finish before it goes ahead anyway.
+ */
+#define FUSE_ADMISSION_TIMEOUT             1
+
+/*
+ * Bytes of requests a weight 1 flow may hand to the daemon per round of
+ * fair queuing.
+ */
+#define FUSE_DEFAULT_FAIR_QUANTUM          (64 * 1024)
+#define FUSE_MIN_FAIR_QUANTUM              PAGE_SIZE
+#define FUSE_MAX_FAIR_QUANTUM              FUSE_MAX_IOSIZE
+
+/* Opcodes below this get their recent answer latency tracked. */
+#define FUSE_SVC_TIME_OPCODES              64
+
+/* Number of FUSE_ACCESS decisions remembered per vnode. */
+#define FUSE_ACCESS_CACHE_SIZE             4
+
 #endif /* KERNEL */
 
 #define FUSE_DEFAULT_USERKERNEL_BUFSIZE    FUSE_MAX_IOSIZE
@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2011 Anatol Pomozov. All Rights Reserved.
+ */
+
+#ifndef _FUSE_TRACE_H_
+#define _FUSE_TRACE_H_
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+/*
+ * Request tracing. Every mount can keep a ring of fixed-size records, one
+ * for each request the kernel queues for the daemon, hands to the daemon
+ * and gets an answer for. Tracing is off until FUSEDEVIOCTRACESET is issued
+ * with a non-zero number of records, which is rounded up to a power of two.
+ * The ring is allocated at that time and kept until the file system goes
+ * away; later calls only turn tracing on and off.
+ *
+ * FUSEDEVIOCTRACEREAD copies the records logged since the last call out to
+ * buf and reports how many records were overwritten before they could be
+ * read. Both ioctls can be issued on the device of the mount or on any
+ * spare /dev/fuse4x<n> opened by the user the daemon runs as.
+ */
+
+#define FUSE4X_TRACE_MAX_RECORDS          (1 << 18)
+
+enum {
+    FUSE4X_TRACE_SUBMIT  = 1, /* queued for the daemon */
+    FUSE4X_TRACE_DEQUEUE = 2, /* read by the daemon */
+    FUSE4X_TRACE_REPLY   = 3  /* answered by the daemon */
+};
+
+struct fuse_trace_record {
+    uint64_t seq;          /* position in the ring plus one, 0 while being written */
+    uint64_t time;         /* nanoseconds since boot */
+    uint64_t unique;
+    uint64_t nodeid;
+    uint32_t event;
+    uint32_t opcode;
+    int32_t  pid;
+    uint32_t size;         /* bytes sent to the daemon */
+    uint32_t queue_wait;   /* ns from submit to dequeue, for DEQUEUE and REPLY */
+    uint32_t service_time; /* ns from dequeue to reply, for REPLY */
+    int32_t  result;       /* errno of the answer, for REPLY */
+    uint32_t reserved;
+};
+
+struct fuse_trace_setup {
+    uint32_t unit;         /* /dev/fuse4x<unit> the file system is served through */
+    uint32_t nrecords;     /* 0 turns tracing off */
+};
+
+/* Fails with EBUSY while another read of the same ring is in progress. */
+struct fuse_trace_read {
+    uint32_t unit;
+    uint32_t count;        /* room in buf, in records */
+    uint64_t buf;          /* user address of struct fuse_trace_record[count] */
+    uint32_t returned;     /* out: records copied to buf */
+    uint32_t reserved;
+    uint64_t lost;         /* out: records overwritten since the last read */
+};
+
+#define FUSEDEVIOCTRACESET                _IOW('F', 4, struct fuse_trace_setup)
+#define FUSEDEVIOCTRACEREAD               _IOWR('F', 5, struct fuse_trace_read)
+
+/*
+ * Message capture. Works like the trace but logs the messages themselves as
+ * they cross the device: every request the daemon reads and every answer it
+ * writes, with the first FUSE4X_CAPTURE_BYTES bytes of the message. That is
+ * the fuse_in_header or fuse_out_header and, for requests, the operation's
+ * own input structure and names; bulk data is only accounted for in
+ * length. Set up and drained with FUSEDEVIOCCAPTURESET and
+ * FUSEDEVIOCCAPTUREREAD, which take the same arguments as their trace
+ * counterparts but fill buf with struct fuse_capture_record.
+ */
+
+#define FUSE4X_CAPTURE_BYTES              320
+#define FUSE4X_CAPTURE_MAX_RECORDS        (1 << 16)
+
+enum {
+    FUSE4X_CAPTURE_REQUEST = 1, /* read by the daemon */
+    FUSE4X_CAPTURE_REPLY   = 2  /* written by the daemon */
+};
+
+struct fuse_capture_record {
+    uint64_t seq;          /* position in the ring plus one, 0 while being written */
+    uint64_t time;         /* nanoseconds since boot */
+    uint32_t direction;
+    uint32_t length;       /* length of the whole message */
+    uint32_t captured;     /* bytes of it in data */
+    uint32_t reserved;
+    uint8_t  data[FUSE4X_CAPTURE_BYTES];
+};
+
+#define FUSEDEVIOCCAPTURESET              _IOW('F', 6, struct fuse_trace_setup)
+#define FUSEDEVIOCCAPTUREREAD             _IOWR('F', 7, struct fuse_trace_read)
+
+#endif /* _FUSE_TRACE_H_ */
@@ -0,0 +1,804 @@
+/*
+ * Copyright (C) 2011 Anatol Pomozov. All Rights Reserved.
+ */
+
+/*
+ * User space models of kernel hot paths, for before and after measurements.
+ *
+ *   fuse4x_bench readdir [entries] [rounds]
+ *       converts a synthetic FUSE_READDIR reply into struct dirent records
+ *       one record and one uiomove at a time, as the kernel used to, and by
+ *       staging the whole reply for a single uiomove, as it does now
+ *
+ *   fuse4x_bench queue [producers] [messages] [readers]
+ *       has producer threads send messages to reader threads through a
+ *       channel whose queue is guarded by ms_mtx, as it used to be, and
+ *       through the ms_pending stack with the ms_sleepers/ms_woken wakeup
+ *       protocol; checks that no message is lost, duplicated or reordered
+ *       and that no reader sleeps through a pending message
+ *
+ *   fuse4x_bench insert [threads] [requests]
+ *       the same with one daemon thread that also answers every request,
+ *       comparing fuse_insert_callback() plus fuse_insert_message() with
+ *       fuse_insert_request(); checks that every request is registered on
+ *       the answer list by the time the daemon reads it
+ *
+ * The kernel code cannot be linked into a user program, so the loops below
+ * follow the kernel functions they are named after line by line. uiomove()
+ * is modelled as a walk over the iovecs and a memcpy; the real one also pays
+ * for entering and leaving the user address space on every call, so the
+ * savings measured here for fewer calls are a lower bound.
+ *
+ * Builds anywhere:
+ *   cc -O2 -Icommon -o fuse4x_bench fuse4x_bench.c -lpthread
+ */
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/queue.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "fuse4x_tools.h"
+
+#define BENCH_MAXNAMLEN 255
+
+static uint64_t
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void *
+xmalloc(size_t size)
+{
+    void *p = calloc(1, size);
+
+    if (!p) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+/* uio */
+
+struct bench_uio {
+    struct iovec *iov;
+    int           iovcnt;
+    size_t        resid;
+    off_t         offset;
+};
+
+static __attribute__((noinline)) int
+bench_uiomove(const void *src, size_t n, struct bench_uio *uio)
+{
+    const char *p = src;
+
+    if (n > uio->resid) {
+        return 14; /* EFAULT */
+    }
+
+    while (n && uio->iovcnt) {
+        size_t chunk = n < uio->iov->iov_len ? n : uio->iov->iov_len;
+
+        memcpy(uio->iov->iov_base, p, chunk);
+        uio->iov->iov_base = (char *)uio->iov->iov_base + chunk;
+        uio->iov->iov_len -= chunk;
+        if (!uio->iov->iov_len) {
+            uio->iov++;
+            uio->iovcnt--;
+        }
+        p += chunk;
+        n -= chunk;
+        uio->resid -= chunk;
+        uio->offset += (off_t)chunk;
+    }
+
+    return 0;
+}
+
+/* readdir */
+
+/* struct dirent with 64-bit inodes, as handed out by the kernel. */
+struct bench_dirent {
+    uint64_t d_ino;
+    uint64_t d_seekoff;
+    uint16_t d_reclen;
+    uint16_t d_namlen;
+    uint8_t  d_type;
+    char     d_name[BENCH_MAXNAMLEN + 1];
+} __attribute__((packed, aligned(4)));
+
+#define BENCH_DIRENT_LEN(namelen) \
+    ((sizeof(struct bench_dirent) - (BENCH_MAXNAMLEN + 1)) + (((namelen) + 1 + 3) & ~3))
+
+/* A FUSE_READDIR answer of n entries with names like ls(1) sees in a build tree. */
+static void *
+readdir_reply(size_t n, size_t *size)
+{
+    size_t i;
+    size_t off = 0;
+    char *buf = xmalloc(n * FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET + 32));
+
+    for (i = 0; i < n; i++) {
+        struct fuse_dirent *fudge = (struct fuse_dirent *)(buf + off);
+        char name[32];
+        int len = snprintf(name, sizeof(name), "object_%06zu.%s", i,
+                           (i % 3) ? "o" : "dep");
+
+        fudge->ino = i + 2;
+        fudge->off = i + 1;
+        fudge->namelen = (uint32_t)len;
+        fudge->type = 8;
+        memcpy(fudge->name, name, (size_t)len);
+        off += FUSE_DIRENT_SIZE(fudge);
+    }
+
+    *size = off;
+    return buf;
+}
+
+/* fuse_internal_readdir_processdata() before staging: one record at a time. */
+static int
+readdir_per_entry(const void *buf, size_t bufsize, struct bench_uio *uio,
+                  char *cooked)
+{
+    int n = 0;
+    size_t len = sizeof(struct bench_dirent);
+
+    while (bufsize >= FUSE_NAME_OFFSET) {
+        const struct fuse_dirent *fudge = buf;
+        size_t freclen = FUSE_DIRENT_SIZE(fudge);
+        size_t bytesavail = BENCH_DIRENT_LEN(fudge->namelen);
+        struct bench_dirent *de;
+
+        if (bufsize < freclen || bytesavail > uio->resid) {
+            break;
+        }
+
+        /* fiov_refresh() clears the previous record, fiov_adjust() sizes the next */
+        memset(cooked, 0, len);
+        len = bytesavail;
+
+        de = (struct bench_dirent *)cooked;
+        de->d_ino    = fudge->ino;
+        de->d_reclen = (uint16_t)bytesavail;
+        de->d_type   = (uint8_t)fudge->type;
+        de->d_namlen = (uint16_t)fudge->namelen;
+        memcpy(de->d_name, fudge->name, fudge->namelen);
+        cooked[bytesavail] = '\0';
+
+        if (bench_uiomove(cooked, bytesavail, uio)) {
+            return -1;
+        }
+        uio->offset = (off_t)fudge->off;
+
+        n++;
+        buf = (const char *)buf + freclen;
+        bufsize -= freclen;
+    }
+
+    return n;
+}
+
+/* fuse_internal_readdir_processdata() now: stage the reply, copy it out once. */
+static int
+readdir_staged(const void *buf, size_t bufsize, struct bench_uio *uio,
+               char *cooked)
+{
+    int n = 0;
+    size_t staged = 0;
+    size_t stagesize = bufsize + bufsize / 4;
+    off_t lastoff = 0;
+
+    if (stagesize > uio->resid) {
+        stagesize = uio->resid;
+    }
+    memset(cooked, 0, stagesize);
+
+    while (bufsize >= FUSE_NAME_OFFSET) {
+        const struct fuse_dirent *fudge = buf;
+        size_t freclen = FUSE_DIRENT_SIZE(fudge);
+        size_t bytesavail = BENCH_DIRENT_LEN(fudge->namelen);
+        struct bench_dirent *de;
+
+        if (bufsize < freclen || staged + bytesavail > stagesize) {
+            break;
+        }
+
+        de = (struct bench_dirent *)(cooked + staged);
+        de->d_ino    = fudge->ino;
+        de->d_reclen = (uint16_t)bytesavail;
+        de->d_type   = (uint8_t)fudge->type;
+        de->d_namlen = (uint16_t)fudge->namelen;
+        memcpy(de->d_name, fudge->name, fudge->namelen);
+
+        staged += bytesavail;
+        lastoff = (off_t)fudge->off;
+        n++;
+        buf = (const char *)buf + freclen;
+        bufsize -= freclen;
+    }
+
+    if (staged) {
+        if (bench_uiomove(cooked, staged, uio)) {
+            return -1;
+        }
+        uio->offset = lastoff;
+    }
+
+    return n;
+}
+
+typedef int (readdir_fn)(const void *, size_t, struct bench_uio *, char *);
+
+static double
+readdir_run(readdir_fn *fn, const void *reply, size_t size, size_t entries,
+            unsigned rounds, char *out, size_t outsize, char *cooked)
+{
+    unsigned r;
+    uint64_t best = UINT64_MAX;
+
+    for (r = 0; r < rounds; r++) {
+        struct iovec iov = { out, outsize };
+        struct bench_uio uio = { &iov, 1, outsize, 0 };
+        uint64_t start = now();
+        int n = fn(reply, size, &uio, cooked);
+        uint64_t t = now() - start;
+
+        if (n != (int)entries) {
+            fprintf(stderr, "converted %d entries out of %zu\n", n, entries);
+            exit(EXIT_FAILURE);
+        }
+        if (t < best) {
+            best = t;
+        }
+    }
+
+    return (double)best / (double)entries;
+}
+
+static int
+bench_readdir(size_t entries, unsigned rounds)
+{
+    size_t size;
+    char *reply = readdir_reply(entries, &size);
+    size_t outsize = entries * BENCH_DIRENT_LEN(BENCH_MAXNAMLEN);
+    char *out_old = xmalloc(outsize);
+    char *out_new = xmalloc(outsize);
+    char *cooked = xmalloc(size + size / 4 + sizeof(struct bench_dirent));
+    double before;
+    double after;
+
+    before = readdir_run(readdir_per_entry, reply, size, entries, rounds,
+                         out_old, outsize, cooked);
+    after = readdir_run(readdir_staged, reply, size, entries, rounds,
+                        out_new, outsize, cooked);
+
+    if (memcmp(out_old, out_new, outsize)) {
+        fprintf(stderr, "the two converters disagree\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("readdir: %zu entries, %zu reply bytes, best of %u rounds\n",
+           entries, size, rounds);
+    printf("  per entry uiomove  %7.1f ns/entry\n", before);
+    printf("  staged reply       %7.1f ns/entry\n", after);
+
+    free(reply);
+    free(out_old);
+    free(out_new);
+    free(cooked);
+
+    return EXIT_SUCCESS;
+}
+
+/* channel */
+
+/*
+ * A reader that has been asleep this long with messages pending has missed
+ * its wakeup.
+ */
+#define BENCH_STALL_SECONDS 10
+
+struct bench_ticket {
+    STAILQ_ENTRY(bench_ticket) ms_link;
+    struct bench_ticket       *ms_pending_link;
+    TAILQ_ENTRY(bench_ticket)  aw_link;
+    struct bench_ticket       *aw_pending_link;
+    bool                       registered; // on aw_head, under aw_mtx
+    unsigned                   producer;
+    uint64_t                   seq;
+};
+
+struct bench_chan {
+    bool                            lockfree;
+    bool                            answer;
+    pthread_mutex_t                 ms_mtx;
+    pthread_cond_t                  ms_cv;
+    STAILQ_HEAD(, bench_ticket)     ms_head;
+    _Atomic(struct bench_ticket *)  ms_pending;
+    atomic_uint                     ms_sleepers;
+    atomic_uint                     ms_woken;
+    bool                            dead;
+
+    /* fuse_data */
+    pthread_mutex_t                 aw_mtx;
+    TAILQ_HEAD(, bench_ticket)      aw_head;
+    _Atomic(struct bench_ticket *)  aw_pending;
+
+    /* bookkeeping, under ms_mtx */
+    uint64_t                       *expected;
+    uint64_t                        total;
+    atomic_uint_fast64_t            consumed;
+    uint64_t                        finished;
+    const char                     *failure;
+};
+
+struct bench_producer {
+    struct bench_chan   *chan;
+    struct bench_ticket *tickets;
+    uint64_t             count;
+    uint64_t             elapsed;
+};
+
+#define BENCH_LOAD(x)     atomic_load_explicit(&(x), memory_order_relaxed)
+#define BENCH_STORE(x, v) atomic_store_explicit(&(x), (v), memory_order_relaxed)
+
+/* fuse_insert_message() before ms_pending: every message takes ms_mtx. */
+static void
+chan_insert_locked(struct bench_chan *chan, struct bench_ticket *ticket)
+{
+    pthread_mutex_lock(&chan->ms_mtx);
+    STAILQ_INSERT_TAIL(&chan->ms_head, ticket, ms_link);
+    pthread_cond_signal(&chan->ms_cv);
+    pthread_mutex_unlock(&chan->ms_mtx);
+}
+
+/* fuse_insert_message() now. */
+static void
+chan_insert_lockfree(struct bench_chan *chan, struct bench_ticket *ticket)
+{
+    struct bench_ticket *top = atomic_load_explicit(&chan->ms_pending,
+                                                    memory_order_relaxed);
+
+    do {
+        ticket->ms_pending_link = top;
+    } while (!atomic_compare_exchange_weak(&chan->ms_pending, &top, ticket));
+
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if (BENCH_LOAD(chan->ms_sleepers) > BENCH_LOAD(chan->ms_woken)) {
+        pthread_mutex_lock(&chan->ms_mtx);
+        if (BENCH_LOAD(chan->ms_sleepers) > BENCH_LOAD(chan->ms_woken)) {
+            BENCH_STORE(chan->ms_woken, BENCH_LOAD(chan->ms_woken) + 1);
+            pthread_cond_signal(&chan->ms_cv);
+        }
+        pthread_mutex_unlock(&chan->ms_mtx);
+    }
+}
+
+/* fuse_channel_collect() without the flows. Called with ms_mtx held. */
+static void
+chan_collect(struct bench_chan *chan)
+{
+    struct bench_ticket *top;
+    struct bench_ticket *ticket;
+    STAILQ_HEAD(, bench_ticket) batch = STAILQ_HEAD_INITIALIZER(batch);
+
+    do {
+        top = atomic_load(&chan->ms_pending);
+    } while (top && !atomic_compare_exchange_weak(&chan->ms_pending, &top, NULL));
+
+    while ((ticket = top)) {
+        top = ticket->ms_pending_link;
+        STAILQ_INSERT_HEAD(&batch, ticket, ms_link);
+    }
+
+    STAILQ_CONCAT(&chan->ms_head, &batch);
+}
+
+/* fuse_insert_callback() before fuse_insert_request(). */
+static void
+chan_register_locked(struct bench_chan *chan, struct bench_ticket *ticket)
+{
+    pthread_mutex_lock(&chan->aw_mtx);
+    TAILQ_INSERT_TAIL(&chan->aw_head, ticket, aw_link);
+    ticket->registered = true;
+    pthread_mutex_unlock(&chan->aw_mtx);
+}
+
+/* The registration half of fuse_insert_request(). */
+static void
+chan_register_lockfree(struct bench_chan *chan, struct bench_ticket *ticket)
+{
+    struct bench_ticket *top = atomic_load_explicit(&chan->aw_pending,
+                                                    memory_order_relaxed);
+
+    do {
+        ticket->aw_pending_link = top;
+    } while (!atomic_compare_exchange_weak(&chan->aw_pending, &top, ticket));
+}
+
+/* fuse_collect_requests(). Called with aw_mtx held. */
+static void
+chan_collect_requests(struct bench_chan *chan)
+{
+    struct bench_ticket *top;
+    struct bench_ticket *ticket;
+    TAILQ_HEAD(, bench_ticket) batch = TAILQ_HEAD_INITIALIZER(batch);
+
+    do {
+        top = atomic_load(&chan->aw_pending);
+    } while (top && !atomic_compare_exchange_weak(&chan->aw_pending, &top, NULL));
+
+    while ((ticket = top)) {
+        top = ticket->aw_pending_link;
+        ticket->registered = true;
+        TAILQ_INSERT_HEAD(&batch, ticket, aw_link);
+    }
+
+    TAILQ_CONCAT(&chan->aw_head, &batch, aw_link);
+}
+
+/*
+ * fuse_device_write() finding the ticket an answer is for. The kernel
+ * looks it up by unique; the model already has the ticket in hand.
+ */
+static void
+chan_answer(struct bench_chan *chan, struct bench_ticket *ticket)
+{
+    pthread_mutex_lock(&chan->aw_mtx);
+    if (chan->lockfree) {
+        chan_collect_requests(chan);
+    }
+    if (!ticket->registered) {
+        fprintf(stderr, "request %u/%" PRIu64 " was read before it was registered\n",
+                ticket->producer, ticket->seq);
+        exit(EXIT_FAILURE);
+    }
+    TAILQ_REMOVE(&chan->aw_head, ticket, aw_link);
+    ticket->registered = false;
+    pthread_mutex_unlock(&chan->aw_mtx);
+}
+
+/*
+ * Called with ms_mtx held for every message a reader takes. Messages of one
+ * producer have to come out in the order it sent them.
+ */
+static void
+chan_account(struct bench_chan *chan, struct bench_ticket *ticket)
+{
+    if (ticket->seq != chan->expected[ticket->producer]) {
+        chan->failure = (ticket->seq < chan->expected[ticket->producer]) ?
+                        "a message was delivered twice" :
+                        "a message was lost or overtaken";
+    }
+    chan->expected[ticket->producer] = ticket->seq + 1;
+
+    if (atomic_fetch_add(&chan->consumed, 1) + 1 == chan->total || chan->failure) {
+        chan->finished = now();
+        chan->dead = true;
+        pthread_cond_broadcast(&chan->ms_cv);
+    }
+}
+
+/* fuse_device_read() before ms_pending. */
+static void
+chan_read_locked(struct bench_chan *chan)
+{
+    struct bench_ticket *ticket;
+
+    pthread_mutex_lock(&chan->ms_mtx);
+    while (!chan->dead) {
+        if ((ticket = STAILQ_FIRST(&chan->ms_head))) {
+            STAILQ_REMOVE_HEAD(&chan->ms_head, ms_link);
+            chan_account(chan, ticket);
+            pthread_mutex_unlock(&chan->ms_mtx);
+            if (chan->answer) {
+                chan_answer(chan, ticket);
+            }
+            pthread_mutex_lock(&chan->ms_mtx);
+        } else {
+            pthread_cond_wait(&chan->ms_cv, &chan->ms_mtx);
+        }
+    }
+    pthread_mutex_unlock(&chan->ms_mtx);
+}
+
+/* fuse_device_read() now. */
+static void
+chan_read_lockfree(struct bench_chan *chan)
+{
+    struct bench_ticket *ticket;
+
+    pthread_mutex_lock(&chan->ms_mtx);
+
+again:
+    if (chan->dead) {
+        pthread_mutex_unlock(&chan->ms_mtx);
+        return;
+    }
+
+    chan_collect(chan);
+
+    if ((ticket = STAILQ_FIRST(&chan->ms_head))) {
+        STAILQ_REMOVE_HEAD(&chan->ms_head, ms_link);
+
+        if (!STAILQ_EMPTY(&chan->ms_head) &&
+            BENCH_LOAD(chan->ms_sleepers) > BENCH_LOAD(chan->ms_woken)) {
+            BENCH_STORE(chan->ms_woken, BENCH_LOAD(chan->ms_woken) + 1);
+            pthread_cond_signal(&chan->ms_cv);
+        }
+
+        chan_account(chan, ticket);
+        pthread_mutex_unlock(&chan->ms_mtx);
+        if (chan->answer) {
+            chan_answer(chan, ticket);
+        }
+        pthread_mutex_lock(&chan->ms_mtx);
+        goto again;
+    }
+
+    BENCH_STORE(chan->ms_sleepers, BENCH_LOAD(chan->ms_sleepers) + 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    chan_collect(chan);
+    if (!STAILQ_EMPTY(&chan->ms_head)) {
+        BENCH_STORE(chan->ms_sleepers, BENCH_LOAD(chan->ms_sleepers) - 1);
+        goto again;
+    }
+
+    pthread_cond_wait(&chan->ms_cv, &chan->ms_mtx);
+    BENCH_STORE(chan->ms_sleepers, BENCH_LOAD(chan->ms_sleepers) - 1);
+    if (BENCH_LOAD(chan->ms_woken)) {
+        BENCH_STORE(chan->ms_woken, BENCH_LOAD(chan->ms_woken) - 1);
+    }
+    atomic_thread_fence(memory_order_seq_cst);
+    goto again;
+}
+
+static void *
+chan_producer(void *arg)
+{
+    struct bench_producer *prod = arg;
+    struct bench_chan *chan = prod->chan;
+    uint64_t i;
+    uint64_t start = now();
+
+    for (i = 0; i < prod->count; i++) {
+        struct bench_ticket *ticket = &prod->tickets[i];
+
+        if (chan->lockfree) {
+            if (chan->answer) {
+                chan_register_lockfree(chan, ticket);
+            }
+            chan_insert_lockfree(chan, ticket);
+        } else {
+            if (chan->answer) {
+                chan_register_locked(chan, ticket);
+            }
+            chan_insert_locked(chan, ticket);
+        }
+    }
+
+    prod->elapsed = now() - start;
+    return NULL;
+}
+
+static void *
+chan_reader(void *arg)
+{
+    struct bench_chan *chan = arg;
+
+    if (chan->lockfree) {
+        chan_read_lockfree(chan);
+    } else {
+        chan_read_locked(chan);
+    }
+    return NULL;
+}
+
+struct chan_result {
+    double submit;     /* ns a producer spends per message */
+    double throughput; /* messages per second through the channel */
+};
+
+/* Runs one round; returns false if the protocol misbehaved. */
+static bool
+chan_run(bool lockfree, bool answer, unsigned producers, uint64_t messages,
+         unsigned readers, struct chan_result *result)
+{
+    struct bench_chan chan;
+    struct bench_producer *prod = xmalloc(producers * sizeof(*prod));
+    struct bench_ticket *tickets = xmalloc(producers * messages * sizeof(*tickets));
+    pthread_t *threads = xmalloc((producers + readers) * sizeof(*threads));
+    uint64_t start, submit = 0;
+    uint64_t seen = 0, stalled = 0;
+    unsigned i;
+    bool ok = true;
+
+    memset(&chan, 0, sizeof(chan));
+    chan.lockfree = lockfree;
+    chan.answer = answer;
+    pthread_mutex_init(&chan.ms_mtx, NULL);
+    pthread_cond_init(&chan.ms_cv, NULL);
+    STAILQ_INIT(&chan.ms_head);
+    pthread_mutex_init(&chan.aw_mtx, NULL);
+    TAILQ_INIT(&chan.aw_head);
+    chan.expected = xmalloc(producers * sizeof(uint64_t));
+    chan.total = producers * messages;
+
+    for (i = 0; i < producers; i++) {
+        uint64_t j;
+
+        prod[i].chan = &chan;
+        prod[i].tickets = &tickets[i * messages];
+        prod[i].count = messages;
+        for (j = 0; j < messages; j++) {
+            prod[i].tickets[j].producer = i;
+            prod[i].tickets[j].seq = j;
+        }
+    }
+
+    start = now();
+    for (i = 0; i < readers; i++) {
+        pthread_create(&threads[producers + i], NULL, chan_reader, &chan);
+    }
+    for (i = 0; i < producers; i++) {
+        pthread_create(&threads[i], NULL, chan_producer, &prod[i]);
+    }
+
+    /* Every message is eventually read, unless a wakeup went missing. */
+    while (atomic_load(&chan.consumed) < chan.total) {
+        struct timespec tick = { 0, 10 * 1000 * 1000 };
+        uint64_t consumed = atomic_load(&chan.consumed);
+
+        if (chan.failure) {
+            break;
+        }
+        if (consumed != seen) {
+            seen = consumed;
+            stalled = 0;
+        } else if (++stalled == BENCH_STALL_SECONDS * 100) {
+            fprintf(stderr, "%s: no progress for %d seconds at %" PRIu64
+                    " of %" PRIu64 " messages, sleepers %u, woken %u\n",
+                    lockfree ? "ms_pending" : "ms_mtx", BENCH_STALL_SECONDS,
+                    consumed, chan.total, atomic_load(&chan.ms_sleepers),
+                    atomic_load(&chan.ms_woken));
+            exit(EXIT_FAILURE);
+        }
+        nanosleep(&tick, NULL);
+    }
+
+    for (i = 0; i < producers + readers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    if (chan.failure) {
+        fprintf(stderr, "%s: %s\n", lockfree ? "ms_pending" : "ms_mtx",
+                chan.failure);
+        ok = false;
+    }
+    for (i = 0; ok && i < producers; i++) {
+        if (chan.expected[i] != messages) {
+            fprintf(stderr, "producer %u: %" PRIu64 " of %" PRIu64 " messages read\n",
+                    i, chan.expected[i], messages);
+            ok = false;
+        }
+        submit += prod[i].elapsed;
+    }
+    if (ok && (!STAILQ_EMPTY(&chan.ms_head) || atomic_load(&chan.ms_pending))) {
+        fprintf(stderr, "messages left over after the last one was read\n");
+        ok = false;
+    }
+    if (ok && (!TAILQ_EMPTY(&chan.aw_head) || atomic_load(&chan.aw_pending))) {
+        fprintf(stderr, "requests left over after the last one was answered\n");
+        ok = false;
+    }
+
+    result->submit = (double)submit / (double)chan.total;
+    result->throughput = (double)chan.total * 1e9 / (double)(chan.finished - start);
+
+    pthread_mutex_destroy(&chan.ms_mtx);
+    pthread_cond_destroy(&chan.ms_cv);
+    pthread_mutex_destroy(&chan.aw_mtx);
+    free(chan.expected);
+    free(threads);
+    free(tickets);
+    free(prod);
+
+    return ok;
+}
+
+/* Best of a few rounds for the old and the new channel. */
+static int
+chan_compare(bool answer, unsigned producers, uint64_t messages,
+             unsigned readers, unsigned rounds)
+{
+    const char *queue_names[2] = { "ms_mtx queue", "ms_pending stack" };
+    const char *insert_names[2] = { "callback + message", "insert_request" };
+    const char **names = answer ? insert_names : queue_names;
+    const char *title = answer ? "insert" : "queue";
+    unsigned mode, r;
+
+    printf("%s: %u producers x %" PRIu64 " messages, %u readers, best of %u rounds\n",
+           title, producers, messages, readers, rounds);
+
+    for (mode = 0; mode < 2; mode++) {
+        struct chan_result best = { 0, 0 };
+
+        for (r = 0; r < rounds; r++) {
+            struct chan_result res;
+
+            if (!chan_run(mode == 1, answer, producers, messages, readers, &res)) {
+                return EXIT_FAILURE;
+            }
+            if (r == 0 || res.submit < best.submit) {
+                best.submit = res.submit;
+            }
+            if (res.throughput > best.throughput) {
+                best.throughput = res.throughput;
+            }
+        }
+
+        printf("  %-18s %7.1f ns/message to send %9.0f messages/s\n",
+               names[mode], best.submit, best.throughput);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr, "usage: fuse4x_bench readdir [entries] [rounds]\n"
+                    "       fuse4x_bench queue [producers] [messages] [readers]\n"
+                    "       fuse4x_bench insert [threads] [requests]\n");
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, const char *argv[])
+{
+    if (argc >= 2 && strcmp(argv[1], "readdir") == 0) {
+        size_t entries = argc > 2 ? (size_t)strtoul(argv[2], NULL, 0) : 10000;
+        unsigned rounds = argc > 3 ? (unsigned)strtoul(argv[3], NULL, 0) : 200;
+        if (entries == 0 || rounds == 0) {
+            usage();
+        }
+        return bench_readdir(entries, rounds);
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "queue") == 0) {
+        unsigned producers = argc > 2 ? (unsigned)strtoul(argv[2], NULL, 0) : 4;
+        uint64_t messages = argc > 3 ? strtoull(argv[3], NULL, 0) : 250000;
+        unsigned readers = argc > 4 ? (unsigned)strtoul(argv[4], NULL, 0) : 2;
+        if (producers == 0 || messages == 0 || readers == 0) {
+            usage();
+        }
+        return chan_compare(false, producers, messages, readers, 5);
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "insert") == 0) {
+        unsigned threads = argc > 2 ? (unsigned)strtoul(argv[2], NULL, 0) : 4;
+        uint64_t requests = argc > 3 ? strtoull(argv[3], NULL, 0) : 250000;
+        if (threads == 0 || requests == 0) {
+            usage();
+        }
+        return chan_compare(true, threads, requests, 1, 5);
+    }
+
+    usage();
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,680 @@
+/*
+ * Copyright (C) 2011 Anatol Pomozov. All Rights Reserved.
+ */
+
+/*
+ * Replays the requests of a capture taken with "fuse4x_trace capture"
+ * against a daemon and reports the latency it answered them with.
+ *
+ *   fuse4x_replay [-s speed] [-w window] <file> [command [args...]]
+ *
+ * The daemon is talked to over a socket instead of the device, with the
+ * same framing: every message starts with its fuse_in_header or
+ * fuse_out_header, whose len covers the whole message. The socket is passed
+ * to command as the descriptor in the FUSE4X_REPLAY_FD environment variable.
+ * Without a command the requests go to a built-in daemon that answers
+ * everything with success and made-up attributes, which measures the cost
+ * of the replay itself.
+ *
+ * Requests are sent in the order they were read by the daemon when they
+ * were captured, with fresh unique ids; INTERRUPT requests are left out
+ * since the requests they named are answered by then. Requests are spaced
+ * as they were captured, scaled by 1/speed, and a speed of 0 sends them as
+ * fast as the window of outstanding requests allows. Bulk data was not
+ * captured and is replaced with zeroes.
+ *
+ * Builds anywhere:
+ *   cc -Icommon -o fuse4x_replay fuse4x_replay.c -lpthread
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "fuse4x_tools.h"
+
+#define REPLAY_DEFAULT_WINDOW 64
+#define REPLAY_MAX_MESSAGE    (32 * 1024 * 1024)
+
+/* One captured request. */
+struct request {
+    uint64_t  time;     /* ns since boot at capture time */
+    uint32_t  opcode;
+    uint32_t  length;
+    uint32_t  captured;
+    uint8_t  *data;
+    uint64_t  sent;     /* ns, our clock */
+    bool      answered;
+};
+
+/* Latency samples of one opcode, in nanoseconds. */
+struct series {
+    uint64_t  count;
+    uint64_t  errors;
+    uint64_t  total;
+    uint32_t *samples;
+    size_t    allocated;
+};
+
+static struct request *requests;
+static size_t nrequests;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  room = PTHREAD_COND_INITIALIZER;
+static size_t outstanding;
+static bool daemon_gone;
+static uint64_t bytes_sent;
+static uint64_t bytes_received;
+static struct series ops[TOOLS_MAX_OPCODES];
+
+static uint64_t
+now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000000ULL + (uint64_t)tv.tv_usec * 1000;
+}
+
+static bool
+expects_reply(uint32_t opcode)
+{
+    return opcode != FUSE_FORGET && opcode != FUSE_INTERRUPT;
+}
+
+static int
+write_all(int fd, const void *buf, size_t size)
+{
+    const char *p = buf;
+
+    while (size) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        size -= (size_t)n;
+    }
+
+    return 0;
+}
+
+/* Returns 0 at a clean end of stream, 1 with a full buffer, -1 on errors. */
+static int
+read_all(int fd, void *buf, size_t size)
+{
+    char *p = buf;
+    size_t done = 0;
+
+    while (done < size) {
+        ssize_t n = read(fd, p + done, size - done);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            return done ? -1 : 0;
+        }
+        done += (size_t)n;
+    }
+
+    return 1;
+}
+
+/* Reads one framed message into *buf, growing it as needed. */
+static int
+read_message(int fd, size_t header_size, uint8_t **buf, size_t *size)
+{
+    uint32_t len;
+    int ret;
+
+    ret = read_all(fd, *buf, header_size);
+    if (ret <= 0) {
+        return ret;
+    }
+
+    memcpy(&len, *buf, sizeof(len));
+    if (len < header_size || len > REPLAY_MAX_MESSAGE) {
+        fprintf(stderr, "bad message length %u\n", len);
+        return -1;
+    }
+    if (len > *size) {
+        uint8_t *grown = realloc(*buf, len);
+        if (!grown) {
+            return -1;
+        }
+        *buf = grown;
+        *size = len;
+    }
+
+    if (len > header_size && read_all(fd, *buf + header_size, len - header_size) != 1) {
+        return -1;
+    }
+
+    return 1;
+}
+
+static void
+fake_attr(struct fuse_attr *attr, uint64_t nodeid)
+{
+    memset(attr, 0, sizeof(*attr));
+    attr->ino = nodeid;
+    attr->mode = (nodeid == FUSE_ROOT_ID ? 0040755 : 0100644);
+    attr->nlink = 1;
+    attr->size = 1024 * 1024;
+    attr->blocks = 2048;
+}
+
+/* The built-in daemon: answers every request with success. */
+static int
+serve(int fd)
+{
+    size_t size = 4096;
+    uint8_t *in = malloc(size);
+    uint8_t *out = NULL;
+    size_t out_size = 0;
+    uint64_t next_nodeid = FUSE_ROOT_ID + 1;
+
+    if (!in) {
+        return EXIT_FAILURE;
+    }
+
+    for (;;) {
+        struct fuse_in_header *ih;
+        struct fuse_out_header *oh;
+        size_t body = 0;
+        int ret;
+
+        ret = read_message(fd, sizeof(*ih), &in, &size);
+        if (ret <= 0) {
+            free(in);
+            free(out);
+            return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+        }
+        ih = (struct fuse_in_header *)in;
+
+        if (!expects_reply(ih->opcode)) {
+            continue;
+        }
+
+        switch (ih->opcode) {
+        case FUSE_INIT:
+            body = sizeof(struct fuse_init_out);
+            break;
+        case FUSE_LOOKUP:
+        case FUSE_CREATE:
+        case FUSE_MKDIR:
+        case FUSE_MKNOD:
+        case FUSE_SYMLINK:
+        case FUSE_LINK:
+            body = sizeof(struct fuse_entry_out);
+            if (ih->opcode == FUSE_CREATE) {
+                body += sizeof(struct fuse_open_out);
+            }
+            break;
+        case FUSE_GETATTR:
+        case FUSE_SETATTR:
+            body = sizeof(struct fuse_attr_out);
+            break;
+        case FUSE_OPEN:
+        case FUSE_OPENDIR:
+            body = sizeof(struct fuse_open_out);
+            break;
+        case FUSE_READ:
+            if (ih->len >= sizeof(*ih) + sizeof(struct fuse_read_in)) {
+                body = ((struct fuse_read_in *)(ih + 1))->size;
+            }
+            break;
+        case FUSE_WRITE:
+            body = sizeof(struct fuse_write_out);
+            break;
+        case FUSE_STATFS:
+            body = sizeof(struct fuse_statfs_out);
+            break;
+        }
+
+        if (sizeof(*oh) + body > out_size) {
+            out_size = sizeof(*oh) + body;
+            free(out);
+            out = malloc(out_size);
+            if (!out) {
+                free(in);
+                return EXIT_FAILURE;
+            }
+        }
+        memset(out, 0, sizeof(*oh) + body);
+
+        oh = (struct fuse_out_header *)out;
+        oh->len = (uint32_t)(sizeof(*oh) + body);
+        oh->unique = ih->unique;
+
+        switch (ih->opcode) {
+        case FUSE_INIT: {
+            struct fuse_init_out *o = (struct fuse_init_out *)(oh + 1);
+            o->major = FUSE_KERNEL_VERSION;
+            o->minor = FUSE_KERNEL_MINOR_VERSION;
+            o->max_write = 128 * 1024;
+            break;
+        }
+        case FUSE_LOOKUP:
+        case FUSE_CREATE:
+        case FUSE_MKDIR:
+        case FUSE_MKNOD:
+        case FUSE_SYMLINK:
+        case FUSE_LINK: {
+            struct fuse_entry_out *o = (struct fuse_entry_out *)(oh + 1);
+            o->nodeid = next_nodeid++;
+            o->entry_valid = 1;
+            o->attr_valid = 1;
+            fake_attr(&o->attr, o->nodeid);
+            break;
+        }
+        case FUSE_GETATTR:
+        case FUSE_SETATTR: {
+            struct fuse_attr_out *o = (struct fuse_attr_out *)(oh + 1);
+            o->attr_valid = 1;
+            fake_attr(&o->attr, ih->nodeid);
+            break;
+        }
+        case FUSE_WRITE:
+            if (ih->len >= sizeof(*ih) + sizeof(struct fuse_write_in)) {
+                ((struct fuse_write_out *)(oh + 1))->size =
+                    ((struct fuse_write_in *)(ih + 1))->size;
+            }
+            break;
+        case FUSE_STATFS: {
+            struct fuse_statfs_out *o = (struct fuse_statfs_out *)(oh + 1);
+            o->st.blocks = o->st.bfree = o->st.bavail = 1 << 20;
+            o->st.files = o->st.ffree = 1 << 20;
+            o->st.bsize = o->st.frsize = 4096;
+            o->st.namelen = 255;
+            break;
+        }
+        }
+
+        if (write_all(fd, out, oh->len) < 0) {
+            free(in);
+            free(out);
+            return EXIT_FAILURE;
+        }
+    }
+}
+
+static int
+load(const char *path)
+{
+    FILE *in;
+    struct tools_file_header header;
+    struct fuse_capture_record rec;
+    size_t allocated = 0;
+
+    in = fopen(path, "rb");
+    if (!in) {
+        perror(path);
+        return -1;
+    }
+
+    if (fread(&header, sizeof(header), 1, in) != 1 ||
+        memcmp(header.magic, CAPTURE_FILE_MAGIC, sizeof(header.magic)) ||
+        header.record_size != sizeof(struct fuse_capture_record)) {
+        fprintf(stderr, "%s: not a fuse4x capture\n", path);
+        fclose(in);
+        return -1;
+    }
+
+    while (fread(&rec, sizeof(rec), 1, in) == 1) {
+        struct fuse_in_header *ih = (struct fuse_in_header *)rec.data;
+        struct request *r;
+
+        if (rec.direction != FUSE4X_CAPTURE_REQUEST ||
+            rec.captured < sizeof(*ih) || rec.captured > sizeof(rec.data) ||
+            rec.length < rec.captured || rec.length > REPLAY_MAX_MESSAGE ||
+            ih->opcode == FUSE_INTERRUPT) {
+            continue;
+        }
+
+        if (nrequests == allocated) {
+            allocated = allocated ? 2 * allocated : 1024;
+            requests = realloc(requests, allocated * sizeof(*requests));
+            if (!requests) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        r = &requests[nrequests++];
+        memset(r, 0, sizeof(*r));
+        r->time = rec.time;
+        r->opcode = ih->opcode;
+        r->length = rec.length;
+        r->captured = rec.captured;
+        r->data = malloc(rec.captured);
+        if (!r->data) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(r->data, rec.data, rec.captured);
+    }
+    fclose(in);
+
+    return 0;
+}
+
+/* Puts a made-up INIT in front of captures that were started after it. */
+static void
+prepend_init(void)
+{
+    struct fuse_in_header *ih;
+    struct fuse_init_in *ii;
+    size_t size = sizeof(*ih) + sizeof(*ii);
+
+    if (nrequests && requests[0].opcode == FUSE_INIT) {
+        return;
+    }
+
+    requests = realloc(requests, (nrequests + 1) * sizeof(*requests));
+    if (!requests) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    memmove(&requests[1], &requests[0], nrequests * sizeof(*requests));
+    nrequests++;
+
+    memset(&requests[0], 0, sizeof(requests[0]));
+    requests[0].time = nrequests > 1 ? requests[1].time : 0;
+    requests[0].opcode = FUSE_INIT;
+    requests[0].length = (uint32_t)size;
+    requests[0].captured = (uint32_t)size;
+    requests[0].data = calloc(1, size);
+    if (!requests[0].data) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    ih = (struct fuse_in_header *)requests[0].data;
+    ih->len = (uint32_t)size;
+    ih->opcode = FUSE_INIT;
+    ii = (struct fuse_init_in *)(ih + 1);
+    ii->major = FUSE_KERNEL_VERSION;
+    ii->minor = FUSE_KERNEL_MINOR_VERSION;
+    ii->max_readahead = 128 * 1024;
+}
+
+static void
+series_add(struct series *s, uint64_t latency, int32_t error)
+{
+    if (s->count == s->allocated) {
+        s->allocated = s->allocated ? 2 * s->allocated : 64;
+        s->samples = realloc(s->samples, s->allocated * sizeof(*s->samples));
+        if (!s->samples) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    s->samples[s->count++] = latency > UINT32_MAX ? UINT32_MAX : (uint32_t)latency;
+    s->total += latency;
+    if (error) {
+        s->errors++;
+    }
+}
+
+/* Matches the answers of the daemon to the requests they are for. */
+static void *
+reader(void *arg)
+{
+    int fd = *(int *)arg;
+    size_t size = 4096;
+    uint8_t *buf = malloc(size);
+
+    if (!buf) {
+        return NULL;
+    }
+
+    for (;;) {
+        struct fuse_out_header *oh;
+        struct request *r;
+        uint64_t at;
+
+        if (read_message(fd, sizeof(*oh), &buf, &size) <= 0) {
+            break;
+        }
+        at = now();
+        oh = (struct fuse_out_header *)buf;
+
+        pthread_mutex_lock(&lock);
+        bytes_received += oh->len;
+        if (oh->unique == 0 || oh->unique > nrequests) {
+            /* A notification, or an answer we did not ask for. */
+            pthread_mutex_unlock(&lock);
+            continue;
+        }
+        r = &requests[oh->unique - 1];
+        if (!r->answered && expects_reply(r->opcode)) {
+            r->answered = true;
+            if (r->opcode < TOOLS_MAX_OPCODES) {
+                series_add(&ops[r->opcode], at - r->sent, oh->error);
+            }
+            outstanding--;
+            pthread_cond_signal(&room);
+        }
+        pthread_mutex_unlock(&lock);
+    }
+
+    /* The daemon is gone; nothing else is going to be answered. */
+    pthread_mutex_lock(&lock);
+    daemon_gone = true;
+    pthread_cond_broadcast(&room);
+    pthread_mutex_unlock(&lock);
+
+    free(buf);
+    return NULL;
+}
+
+static void
+report(size_t sent, uint64_t elapsed)
+{
+    size_t i;
+    uint64_t answered = 0;
+    double seconds = (double)elapsed / 1e9;
+
+    for (i = 0; i < TOOLS_MAX_OPCODES; i++) {
+        answered += ops[i].count;
+    }
+
+    printf("%zu requests sent, %" PRIu64 " answered in %.3fs: %.0f req/s, %.1f MB/s\n\n",
+           sent, answered, seconds,
+           seconds > 0 ? (double)answered / seconds : 0.0,
+           seconds > 0 ? (double)(bytes_sent + bytes_received) / seconds / 1e6 : 0.0);
+    printf("%-12s %9s %7s %11s %11s %11s %11s\n", "opcode", "count", "errors",
+           "avg", "p50", "p99", "max");
+
+    for (i = 0; i < TOOLS_MAX_OPCODES; i++) {
+        struct series *s = &ops[i];
+        char name[16];
+
+        if (!s->count) {
+            continue;
+        }
+
+        qsort(s->samples, s->count, sizeof(*s->samples), tools_compare_u32);
+        printf("%-12s %9" PRIu64 " %7" PRIu64 " %9.1fus %9.1fus %9.1fus %9.1fus\n",
+               tools_opcode_name((uint32_t)i, name, sizeof(name)), s->count, s->errors,
+               tools_usec(s->total / s->count),
+               tools_usec(s->samples[s->count / 2]),
+               tools_usec(s->samples[s->count * 99 / 100]),
+               tools_usec(s->samples[s->count - 1]));
+        free(s->samples);
+    }
+}
+
+static int
+replay(int fd, double speed, size_t window)
+{
+    pthread_t thread;
+    uint8_t *buf = NULL;
+    size_t size = 0;
+    uint64_t start;
+    size_t i;
+
+    if (pthread_create(&thread, NULL, reader, &fd)) {
+        perror("pthread_create");
+        return -1;
+    }
+
+    start = now();
+
+    for (i = 0; i < nrequests; i++) {
+        struct request *r = &requests[i];
+        struct fuse_in_header *ih;
+
+        if (speed > 0) {
+            uint64_t due = start + (uint64_t)((double)(r->time - requests[0].time) / speed);
+            uint64_t t = now();
+            if (due > t) {
+                usleep((useconds_t)((due - t) / 1000));
+            }
+        }
+
+        if (r->length > size) {
+            free(buf);
+            size = r->length;
+            buf = malloc(size);
+            if (!buf) {
+                perror("malloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        memcpy(buf, r->data, r->captured);
+        memset(buf + r->captured, 0, r->length - r->captured);
+
+        ih = (struct fuse_in_header *)buf;
+        ih->len = r->length;
+        ih->unique = i + 1;
+
+        pthread_mutex_lock(&lock);
+        /* Let INIT settle before anything else goes out, as the kernel does. */
+        while (!daemon_gone && outstanding >= (i == 1 ? 1 : window)) {
+            pthread_cond_wait(&room, &lock);
+        }
+        if (daemon_gone) {
+            pthread_mutex_unlock(&lock);
+            fprintf(stderr, "the daemon went away after %zu requests\n", i);
+            break;
+        }
+        if (expects_reply(r->opcode)) {
+            outstanding++;
+        }
+        r->sent = now();
+        bytes_sent += r->length;
+        pthread_mutex_unlock(&lock);
+
+        if (write_all(fd, buf, r->length) < 0) {
+            perror("write");
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&lock);
+    while (outstanding && !daemon_gone) {
+        pthread_cond_wait(&room, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+
+    report(i, now() - start);
+
+    shutdown(fd, SHUT_WR);
+    pthread_join(thread, NULL);
+    free(buf);
+
+    return 0;
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr, "usage: fuse4x_replay [-s speed] [-w window] <file> [command [args...]]\n");
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+    double speed = 0;
+    size_t window = REPLAY_DEFAULT_WINDOW;
+    int fds[2];
+    int status;
+    pid_t pid;
+    int ch;
+
+    while ((ch = getopt(argc, argv, "+s:w:")) != -1) {
+        switch (ch) {
+        case 's':
+            speed = strtod(optarg, NULL);
+            break;
+        case 'w':
+            window = (size_t)strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (argc < 1 || speed < 0 || window == 0) {
+        usage();
+    }
+
+    if (load(argv[0]) < 0) {
+        return EXIT_FAILURE;
+    }
+    prepend_init();
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        perror("socketpair");
+        return EXIT_FAILURE;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return EXIT_FAILURE;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        if (argc > 1) {
+            char fd[16];
+            snprintf(fd, sizeof(fd), "%d", fds[1]);
+            setenv("FUSE4X_REPLAY_FD", fd, 1);
+            execvp(argv[1], &argv[1]);
+            perror(argv[1]);
+            _exit(EXIT_FAILURE);
+        }
+        _exit(serve(fds[1]));
+    }
+    close(fds[1]);
+
+    if (replay(fds[0], speed, window) < 0) {
+        kill(pid, SIGTERM);
+    }
+    close(fds[0]);
+    waitpid(pid, &status, 0);
+
+    return EXIT_SUCCESS;
+}
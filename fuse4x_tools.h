@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2011 Anatol Pomozov. All Rights Reserved.
+ */
+
+/* Bits shared by the user space tools fuse4x_trace and fuse4x_replay. */
+
+#ifndef _FUSE4X_TOOLS_H_
+#define _FUSE4X_TOOLS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <fuse_trace.h>
+#include "fuse_kernel.h"
+
+/* Files written by "fuse4x_trace record" and "fuse4x_trace capture". */
+#define TRACE_FILE_MAGIC   "F4XTRACE"
+#define CAPTURE_FILE_MAGIC "F4XCAPTR"
+
+struct tools_file_header {
+    char     magic[8];
+    uint32_t record_size;
+    uint32_t reserved;
+};
+
+#define TOOLS_MAX_OPCODES  64
+
+static const char *tools_opcode_names[TOOLS_MAX_OPCODES] = {
+    [FUSE_LOOKUP]       = "LOOKUP",
+    [FUSE_FORGET]       = "FORGET",
+    [FUSE_GETATTR]      = "GETATTR",
+    [FUSE_SETATTR]      = "SETATTR",
+    [FUSE_READLINK]     = "READLINK",
+    [FUSE_SYMLINK]      = "SYMLINK",
+    [FUSE_MKNOD]        = "MKNOD",
+    [FUSE_MKDIR]        = "MKDIR",
+    [FUSE_UNLINK]       = "UNLINK",
+    [FUSE_RMDIR]        = "RMDIR",
+    [FUSE_RENAME]       = "RENAME",
+    [FUSE_LINK]         = "LINK",
+    [FUSE_OPEN]         = "OPEN",
+    [FUSE_READ]         = "READ",
+    [FUSE_WRITE]        = "WRITE",
+    [FUSE_STATFS]       = "STATFS",
+    [FUSE_RELEASE]      = "RELEASE",
+    [FUSE_FSYNC]        = "FSYNC",
+    [FUSE_SETXATTR]     = "SETXATTR",
+    [FUSE_GETXATTR]     = "GETXATTR",
+    [FUSE_LISTXATTR]    = "LISTXATTR",
+    [FUSE_REMOVEXATTR]  = "REMOVEXATTR",
+    [FUSE_FLUSH]        = "FLUSH",
+    [FUSE_INIT]         = "INIT",
+    [FUSE_OPENDIR]      = "OPENDIR",
+    [FUSE_READDIR]      = "READDIR",
+    [FUSE_RELEASEDIR]   = "RELEASEDIR",
+    [FUSE_FSYNCDIR]     = "FSYNCDIR",
+    [FUSE_GETLK]        = "GETLK",
+    [FUSE_SETLK]        = "SETLK",
+    [FUSE_SETLKW]       = "SETLKW",
+    [FUSE_ACCESS]       = "ACCESS",
+    [FUSE_CREATE]       = "CREATE",
+    [FUSE_INTERRUPT]    = "INTERRUPT",
+    [FUSE_BMAP]         = "BMAP",
+    [FUSE_DESTROY]      = "DESTROY",
+    [FUSE_IOCTL]        = "IOCTL",
+    [FUSE_POLL]         = "POLL",
+    [FUSE_NOTIFY_REPLY] = "NOTIFY_REPLY",
+    [FUSE_FALLOCATE]    = "FALLOCATE",
+    [FUSE_READDIRPLUS]  = "READDIRPLUS",
+    [61]                = "SETVOLNAME",
+    [62]                = "GETXTIMES",
+    [63]                = "EXCHANGE",
+};
+
+static inline const char *
+tools_opcode_name(uint32_t opcode, char *buf, size_t size)
+{
+    if (opcode < TOOLS_MAX_OPCODES && tools_opcode_names[opcode]) {
+        return tools_opcode_names[opcode];
+    }
+
+    snprintf(buf, size, "op%u", opcode);
+    return buf;
+}
+
+static inline int
+tools_compare_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static inline double
+tools_usec(uint64_t ns)
+{
+    return (double)ns / 1000.0;
+}
+
+#endif /* _FUSE4X_TOOLS_H_ */
@@ -0,0 +1,349 @@
+/*
+ * Copyright (C) 2011 Anatol Pomozov. All Rights Reserved.
+ */
+
+/*
+ * Records the request trace of a fuse4x mount and turns it into latency
+ * reports. See common/fuse_trace.h for the kernel side.
+ *
+ *   fuse4x_trace record <unit> <file> [records]
+ *       turns tracing on for the file system served through
+ *       /dev/fuse4x<unit> and appends its records to file until interrupted
+ *
+ *   fuse4x_trace capture <unit> <file> [records]
+ *       same for the messages crossing the device, for fuse4x_replay
+ *
+ *   fuse4x_trace report <file> [top]
+ *       prints queue wait and service time per opcode, and for the top
+ *       nodes by total service time
+ *
+ * The report mode does not need the kernel extension and builds anywhere:
+ *   cc -Icommon -o fuse4x_trace fuse4x_trace.c
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "fuse4x_tools.h"
+
+#define TRACE_READ_RECORDS 1024
+#define TRACE_POLL_USEC    100000
+
+static volatile sig_atomic_t stop;
+
+static void
+on_signal(__attribute__((unused)) int sig)
+{
+    stop = 1;
+}
+
+/* Drains the trace or capture ring of a mount into path until interrupted. */
+static int
+record(uint32_t unit, const char *path, uint32_t nrecords, bool capture)
+{
+    int fd = -1;
+    int ret = EXIT_FAILURE;
+    char dev[64];
+    FILE *out;
+    uint64_t total = 0;
+    uint64_t lost = 0;
+    struct fuse_trace_setup setup = { unit, nrecords };
+    struct fuse_trace_read req;
+    struct tools_file_header header;
+    unsigned long setcmd  = capture ? FUSEDEVIOCCAPTURESET : FUSEDEVIOCTRACESET;
+    unsigned long readcmd = capture ? FUSEDEVIOCCAPTUREREAD : FUSEDEVIOCTRACEREAD;
+    size_t recsize = capture ? sizeof(struct fuse_capture_record)
+                             : sizeof(struct fuse_trace_record);
+    char *buf;
+
+    buf = calloc(TRACE_READ_RECORDS, recsize);
+    if (!buf) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+
+    out = fopen(path, "ab");
+    if (!out) {
+        perror(path);
+        free(buf);
+        return EXIT_FAILURE;
+    }
+
+    if (ftell(out) == 0) {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, capture ? CAPTURE_FILE_MAGIC : TRACE_FILE_MAGIC,
+               sizeof(header.magic));
+        header.record_size = (uint32_t)recsize;
+        fwrite(&header, sizeof(header), 1, out);
+    }
+
+    /* Any spare device of ours will do to talk about the mount. */
+    for (int i = 0; fd < 0 && i < 1024; i++) {
+        snprintf(dev, sizeof(dev), "/dev/fuse4x%d", i);
+        fd = open(dev, O_RDWR);
+        if (fd < 0 && errno == ENOENT) {
+            break;
+        }
+    }
+    if (fd < 0) {
+        fprintf(stderr, "cannot open a fuse4x device\n");
+        goto out;
+    }
+
+    if (ioctl(fd, setcmd, &setup) < 0) {
+        perror("cannot turn recording on");
+        goto out;
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    while (!stop) {
+        memset(&req, 0, sizeof(req));
+        req.unit  = unit;
+        req.count = TRACE_READ_RECORDS;
+        req.buf   = (uint64_t)(uintptr_t)buf;
+
+        if (ioctl(fd, readcmd, &req) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("cannot read records");
+            break;
+        }
+
+        fwrite(buf, recsize, req.returned, out);
+        total += req.returned;
+        lost += req.lost;
+
+        if (req.returned < TRACE_READ_RECORDS) {
+            usleep(TRACE_POLL_USEC);
+        }
+    }
+
+    setup.nrecords = 0;
+    (void)ioctl(fd, setcmd, &setup);
+
+    fprintf(stderr, "%" PRIu64 " records written, %" PRIu64 " lost\n", total, lost);
+    ret = EXIT_SUCCESS;
+
+out:
+    if (fd >= 0) {
+        close(fd);
+    }
+    fclose(out);
+    free(buf);
+
+    return ret;
+}
+
+/* Latency samples of one opcode or node, in nanoseconds. */
+struct series {
+    uint64_t  key;
+    uint64_t  count;
+    uint64_t  wait_total;
+    uint64_t  service_total;
+    uint64_t  errors;
+    uint32_t *service;
+    size_t    allocated;
+};
+
+static void
+series_add(struct series *s, const struct fuse_trace_record *rec, bool keep)
+{
+    if (keep && s->count == s->allocated) {
+        s->allocated = s->allocated ? 2 * s->allocated : 64;
+        s->service = realloc(s->service, s->allocated * sizeof(*s->service));
+        if (!s->service) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (keep) {
+        s->service[s->count] = rec->service_time;
+    }
+
+    s->count++;
+    s->wait_total += rec->queue_wait;
+    s->service_total += rec->service_time;
+    if (rec->result) {
+        s->errors++;
+    }
+}
+
+static int
+compare_total(const void *a, const void *b)
+{
+    const struct series *x = a;
+    const struct series *y = b;
+
+    return (x->service_total < y->service_total) - (x->service_total > y->service_total);
+}
+
+/* Open addressing on the node id; node ids are never 0. */
+static struct series *
+node_series(struct series **table, size_t *size, size_t *used, uint64_t nodeid)
+{
+    size_t i;
+
+    if (2 * (*used + 1) > *size) {
+        size_t newsize = *size ? 2 * *size : 1024;
+        struct series *grown = calloc(newsize, sizeof(*grown));
+        if (!grown) {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < *size; i++) {
+            if ((*table)[i].key) {
+                size_t j = (*table)[i].key % newsize;
+                while (grown[j].key) {
+                    j = (j + 1) % newsize;
+                }
+                grown[j] = (*table)[i];
+            }
+        }
+        free(*table);
+        *table = grown;
+        *size = newsize;
+    }
+
+    i = nodeid % *size;
+    while ((*table)[i].key && (*table)[i].key != nodeid) {
+        i = (i + 1) % *size;
+    }
+    if (!(*table)[i].key) {
+        (*table)[i].key = nodeid;
+        (*used)++;
+    }
+
+    return &(*table)[i];
+}
+
+static int
+report(const char *path, size_t top)
+{
+    FILE *in;
+    size_t i;
+    uint64_t replies = 0;
+    struct tools_file_header header;
+    struct fuse_trace_record rec;
+    struct series ops[TOOLS_MAX_OPCODES];
+    struct series *nodes = NULL;
+    size_t nodes_size = 0;
+    size_t nodes_used = 0;
+    size_t n;
+
+    in = fopen(path, "rb");
+    if (!in) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+
+    if (fread(&header, sizeof(header), 1, in) != 1 ||
+        memcmp(header.magic, TRACE_FILE_MAGIC, sizeof(header.magic)) ||
+        header.record_size != sizeof(struct fuse_trace_record)) {
+        fprintf(stderr, "%s: not a fuse4x trace\n", path);
+        fclose(in);
+        return EXIT_FAILURE;
+    }
+
+    memset(ops, 0, sizeof(ops));
+
+    while (fread(&rec, sizeof(rec), 1, in) == 1) {
+        if (rec.event != FUSE4X_TRACE_REPLY) {
+            continue;
+        }
+        replies++;
+        if (rec.opcode < TOOLS_MAX_OPCODES) {
+            series_add(&ops[rec.opcode], &rec, true);
+        }
+        if (rec.nodeid) {
+            series_add(node_series(&nodes, &nodes_size, &nodes_used, rec.nodeid), &rec, false);
+        }
+    }
+    fclose(in);
+
+    printf("%" PRIu64 " answered requests\n\n", replies);
+    printf("%-12s %9s %7s %11s %11s %11s %11s %11s\n", "opcode", "count", "errors",
+           "wait avg", "svc avg", "svc p50", "svc p99", "svc max");
+
+    for (i = 0; i < TOOLS_MAX_OPCODES; i++) {
+        struct series *s = &ops[i];
+        char name[16];
+
+        if (!s->count) {
+            continue;
+        }
+
+        qsort(s->service, s->count, sizeof(*s->service), tools_compare_u32);
+        printf("%-12s %9" PRIu64 " %7" PRIu64 " %9.1fus %9.1fus %9.1fus %9.1fus %9.1fus\n",
+               tools_opcode_name((uint32_t)i, name, sizeof(name)), s->count, s->errors,
+               tools_usec(s->wait_total / s->count), tools_usec(s->service_total / s->count),
+               tools_usec(s->service[s->count / 2]),
+               tools_usec(s->service[s->count * 99 / 100]),
+               tools_usec(s->service[s->count - 1]));
+        free(s->service);
+    }
+
+    /* Squeeze the node table and rank it by the time the daemon spent. */
+    for (i = 0, n = 0; i < nodes_size; i++) {
+        if (nodes[i].key) {
+            nodes[n++] = nodes[i];
+        }
+    }
+    qsort(nodes, n, sizeof(*nodes), compare_total);
+
+    printf("\n%-20s %9s %7s %11s %11s %13s\n", "nodeid", "count", "errors",
+           "wait avg", "svc avg", "svc total");
+    for (i = 0; i < n && i < top; i++) {
+        struct series *s = &nodes[i];
+        printf("%-20" PRIu64 " %9" PRIu64 " %7" PRIu64 " %9.1fus %9.1fus %11.1fms\n",
+               s->key, s->count, s->errors,
+               tools_usec(s->wait_total / s->count), tools_usec(s->service_total / s->count),
+               tools_usec(s->service_total) / 1000.0);
+    }
+
+    free(nodes);
+
+    return EXIT_SUCCESS;
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr,
+            "usage: fuse4x_trace record <unit> <file> [records]\n"
+            "       fuse4x_trace capture <unit> <file> [records]\n"
+            "       fuse4x_trace report <file> [top]\n");
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, const char *argv[])
+{
+    if (argc >= 4 && strcmp(argv[1], "record") == 0) {
+        uint32_t nrecords = argc > 4 ? (uint32_t)strtoul(argv[4], NULL, 0) : 65536;
+        return record((uint32_t)strtoul(argv[2], NULL, 0), argv[3], nrecords, false);
+    }
+
+    if (argc >= 4 && strcmp(argv[1], "capture") == 0) {
+        uint32_t nrecords = argc > 4 ? (uint32_t)strtoul(argv[4], NULL, 0) : 16384;
+        return record((uint32_t)strtoul(argv[2], NULL, 0), argv[3], nrecords, true);
+    }
+
+    if (argc >= 3 && strcmp(argv[1], "report") == 0) {
+        size_t top = argc > 3 ? (size_t)strtoul(argv[3], NULL, 0) : 20;
+        return report(argv[2], top);
+    }
+
+    usage();
+    return EXIT_FAILURE;
+}
@@ -55,6 +55,46 @@ fuse_biglock_vnop_access(struct vnop_access_args *ap)
 	nodelocked_vnop(ap->a_vp, fuse_vnop_access, ap);
 }
 
+/*
+ struct vnop_advlock_args {
+ struct vnodeop_desc *a_desc;
+ vnode_t              a_vp;
+ caddr_t              a_id;
+ int                  a_op;
+ struct flock        *a_fl;
+ int                  a_flags;
+ vfs_context_t        a_context;
+ };
+ */
+FUSE_VNOP_EXPORT
+int
+fuse_biglock_vnop_advlock(struct vnop_advlock_args *ap)
+{
+	/*
+	 * No node lock: a request that waits for a lock must not keep the
+	 * holder from unlocking it.
+	 */
+	locked_vnop(ap->a_vp, fuse_vnop_advlock, ap);
+}
+
+/*
+ struct vnop_allocate_args {
+ struct vnodeop_desc *a_desc;
+ vnode_t              a_vp;
+ off_t                a_length;
+ u_int32_t            a_flags;
+ off_t               *a_bytesallocated;
+ off_t                a_offset;
+ vfs_context_t        a_context;
+ };
+ */
+FUSE_VNOP_EXPORT
+int
+fuse_biglock_vnop_allocate(struct vnop_allocate_args *ap)
+{
+	nodelocked_vnop(ap->a_vp, fuse_vnop_allocate, ap);
+}
+
 /*
  struct vnop_blktooff_args {
  struct vnodeop_desc *a_desc;
@@ -167,7 +207,8 @@ FUSE_VNOP_EXPORT
 int
 fuse_biglock_vnop_getattr(struct vnop_getattr_args *ap)
 {
-	nodelocked_vnop(ap->a_vp, fuse_vnop_getattr, ap);
+	/* GETATTR coalescing needs concurrent callers, see fuse_vnop_getattr. */
+	shared_nodelocked_vnop(ap->a_vp, fuse_vnop_getattr, ap);
 }
 
 /*
@@ -254,7 +295,8 @@ fuse_biglock_vnop_lookup(struct vnop_lookup_args *ap)
 	 * has the flags ISLASTCN and LOCKPARENT set, and if the flag
 	 * FSNODELOCKHELD is not set. We only have access to the ISLASTCN and
 	 * LOCKPARENT flags, so we can't do this but should we, and why? */
-	nodelocked_vnop(ap->a_dvp, fuse_vnop_lookup, ap);
+	/* LOOKUP coalescing needs concurrent callers, see fuse_vnop_lookup. */
+	shared_nodelocked_vnop(ap->a_dvp, fuse_vnop_lookup, ap);
 }
 
 /*
@@ -674,8 +716,8 @@ fuse_biglock_vnop_ioctl(struct vnop_ioctl_args *ap)
 
 struct vnodeopv_entry_desc fuse_biglock_vnode_operation_entries[] = {
     { &vnop_access_desc,        (fuse_vnode_op_t) fuse_biglock_vnop_access        },
-    { &vnop_advlock_desc,       (fuse_vnode_op_t) err_advlock             },
-    //  { &vnop_allocate_desc,      (fuse_vnode_op_t) fuse_biglock_vnop_allocate      },
+    { &vnop_advlock_desc,       (fuse_vnode_op_t) fuse_biglock_vnop_advlock       },
+    { &vnop_allocate_desc,      (fuse_vnode_op_t) fuse_biglock_vnop_allocate      },
     { &vnop_blktooff_desc,      (fuse_vnode_op_t) fuse_biglock_vnop_blktooff      },
     { &vnop_blockmap_desc,      (fuse_vnode_op_t) fuse_biglock_vnop_blockmap      },
     //  { &vnop_bwrite_desc,        (fuse_vnode_op_t) fuse_biglock_vnop_bwrite        },
@@ -113,6 +113,25 @@
         return res; \
     } while(0)
 
+/**
+ * Like nodelocked_vnop, but with a shared node lock, for vnops that only
+ * change the node under the biglock. Concurrent callers can then meet in
+ * fuse_internal_flight_join() instead of queueing up on the node lock.
+ */
+#define shared_nodelocked_vnop(vnode, vnop, args) \
+    do { \
+        int res; \
+        vnode_t vp = (vnode); \
+        struct fuse_data *data __unused = fuse_get_mpdata(vnode_mount(vp)); \
+        struct fuse_vnode_data *node = VTOFUD(vp); \
+        fuse_nodelock_lock(node, FUSEFS_SHARED_LOCK); \
+        fuse_biglock_lock(data->biglock); \
+        res = vnop(args); \
+        fuse_biglock_unlock(data->biglock); \
+        fuse_nodelock_unlock(node); \
+        return res; \
+    } while(0)
+
 /**
  * Wrapper that surrounds a vnop call with biglock locking and dual node
  * locking.
@@ -161,9 +180,9 @@ typedef int (*fuse_biglock_vnode_op_t)(void *);
 
 FUSE_VNOP_EXPORT int fuse_biglock_vnop_access(struct vnop_access_args *ap);
 
-// FUSE_VNOP_EXPORT int fuse_biglock_vnop_advlock(struct vnop_advlock_args *ap);
+FUSE_VNOP_EXPORT int fuse_biglock_vnop_advlock(struct vnop_advlock_args *ap);
 
-// FUSE_VNOP_EXPORT int fuse_biglock_vnop_allocate(struct vnop_allocate_args *ap);
+FUSE_VNOP_EXPORT int fuse_biglock_vnop_allocate(struct vnop_allocate_args *ap);
 
 FUSE_VNOP_EXPORT int fuse_biglock_vnop_blktooff(struct vnop_blktooff_args *ap);
 
@@ -19,23 +19,126 @@
 static int  fuse_cdev_major          = -1;
 static bool fuse_interface_available = false;
 
-static struct fuse_device fuse_device_table[FUSE4X_NDEVICES];
+/*
+ * Devices are allocated in batches of FUSE4X_DEVICE_BATCH as the table grows
+ * and are not freed before unload. A batch is completely set up before it is
+ * published in the table, so looking up a unit doesn't need any lock.
+ */
+#define FUSE4X_DEVICE_NBATCHES (FUSE4X_NDEVICES / FUSE4X_DEVICE_BATCH)
 
-#define FUSE_DEVICE_FROM_UNIT_FAST(u) (fuse_device_t)&(fuse_device_table[(u)])
+static struct fuse_device *fuse_device_table[FUSE4X_DEVICE_NBATCHES];
+static int                 fuse_device_nbatches = 0; // protected by fuse_device_mutex
 
-/* Interface for VFS */
-
-/* Doesn't need lock. */
+static __inline__
 fuse_device_t
-fuse_device_get(dev_t dev)
+fuse_device_from_unit(int unit)
 {
-    int unit = minor(dev);
+    struct fuse_device *batch;
 
     if ((unit < 0) || (unit >= FUSE4X_NDEVICES)) {
         return NULL;
     }
 
-    return FUSE_DEVICE_FROM_UNIT_FAST(unit);
+    batch = fuse_device_table[unit / FUSE4X_DEVICE_BATCH];
+    if (!batch) {
+        return NULL;
+    }
+
+    return &batch[unit % FUSE4X_DEVICE_BATCH];
+}
+
+static void
+fuse_devices_free_batch(struct fuse_device *batch, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        devfs_remove(batch[i].cdev);
+        lck_mtx_free(batch[i].mtx, fuse_lock_group);
+    }
+
+    FUSE_OSFree(batch, sizeof(struct fuse_device) * FUSE4X_DEVICE_BATCH,
+                fuse_malloc_tag);
+}
+
+/* Creates the next batch of device nodes. Must be called under fuse_device_mutex. */
+static int
+fuse_devices_grow(void)
+{
+    int i;
+    int base = fuse_device_nbatches * FUSE4X_DEVICE_BATCH;
+    struct fuse_device *batch;
+
+    if (fuse_device_nbatches >= FUSE4X_DEVICE_NBATCHES) {
+        return ENOSPC;
+    }
+
+    batch = (struct fuse_device *)FUSE_OSMalloc(
+                sizeof(struct fuse_device) * FUSE4X_DEVICE_BATCH, fuse_malloc_tag);
+    if (!batch) {
+        return ENOMEM;
+    }
+
+    bzero(batch, sizeof(struct fuse_device) * FUSE4X_DEVICE_BATCH);
+
+    for (i = 0; i < FUSE4X_DEVICE_BATCH; i++) {
+        struct fuse_device *fdev = &batch[i];
+
+        dev_t dev = makedev(fuse_cdev_major, base + i);
+        fdev->cdev = devfs_make_node(dev,
+                                     DEVFS_CHAR,
+                                     UID_ROOT,
+                                     GID_OPERATOR,
+                                     0666,
+                                     FUSE4X_DEVICE_BASENAME "%d",
+                                     base + i);
+        if (fdev->cdev == NULL) {
+            fuse_devices_free_batch(batch, i);
+            return ENXIO;
+        }
+
+        fdev->data     = NULL;
+        fdev->channel  = 0;
+        fdev->dev      = dev;
+        fdev->pid      = -1;
+        fdev->usecount = 0;
+        fdev->mtx      = lck_mtx_alloc_init(fuse_lock_group, fuse_lock_attr);
+    }
+
+    /* The barrier makes the batch contents visible before the pointer. */
+    OSCompareAndSwapPtr(NULL, batch, (void * volatile *)&fuse_device_table[fuse_device_nbatches]);
+    fuse_device_nbatches++;
+
+    return 0;
+}
+
+/*
+ * Keeps a spare batch of nodes around. It is called once a node of the last
+ * batch has been opened, which is the only time open takes fuse_device_mutex.
+ */
+static void
+fuse_devices_reserve(int unit)
+{
+    fuse_lck_mtx_lock(fuse_device_mutex);
+
+    if (fuse_interface_available &&
+        (unit / FUSE4X_DEVICE_BATCH == fuse_device_nbatches - 1)) {
+        int err = fuse_devices_grow();
+        if (err && err != ENOSPC) {
+            log("fuse4x: failed to create more devices (error=%d)\n", err);
+        }
+    }
+
+    fuse_lck_mtx_unlock(fuse_device_mutex);
+}
+
+/* Interface for VFS */
+
+/* Doesn't need lock. */
+fuse_device_t
+fuse_device_get(dev_t dev)
+{
+    return fuse_device_from_unit(minor(dev));
 }
 
 /* Must be called under lock. */
@@ -43,6 +146,10 @@ __inline__
 void
 fuse_device_close_final(fuse_device_t fdev)
 {
+    /* A trace reader may be copying records out without the lock. */
+    fuse_ring_drain(&fdev->data->trace, fdev->mtx);
+    fuse_ring_drain(&fdev->data->capture, fdev->mtx);
+
     fuse_data_destroy(fdev->data);
     fdev->data   = NULL;
     fdev->pid    = -1;
@@ -57,6 +164,8 @@ fuse_reject_answers(struct fuse_data *data)
 
     fuse_lck_mtx_lock(data->aw_mtx);
 
+    fuse_collect_requests(data);
+
     TAILQ_FOREACH(ticket, &data->aw_head, aw_link) {
         fuse_lck_mtx_lock(ticket->aw_mtx);
         ticket->answered = true;
@@ -75,13 +184,14 @@ d_open_t   fuse_device_open;
 d_close_t  fuse_device_close;
 d_read_t   fuse_device_read;
 d_write_t  fuse_device_write;
+d_ioctl_t  fuse_device_ioctl;
 
 static struct cdevsw fuse_device_cdevsw = {
     /* open     */ fuse_device_open,
     /* close    */ fuse_device_close,
     /* read     */ fuse_device_read,
     /* write    */ fuse_device_write,
-    /* ioctl    */ eno_ioctl,
+    /* ioctl    */ fuse_device_ioctl,
     /* stop     */ eno_stop,
     /* reset    */ eno_reset,
     /* ttys     */ NULL,
@@ -103,66 +213,53 @@ fuse_device_open(dev_t dev, __unused int flags, __unused int devtype,
 
     fuse_trace_printf_func();
 
-    if (!fuse_interface_available) {
-        return ENOENT;
-    }
-
     unit = minor(dev);
-    if ((unit >= FUSE4X_NDEVICES) || (unit < 0)) {
-        fuse_lck_mtx_unlock(fuse_device_mutex);
+    fdev = fuse_device_from_unit(unit);
+    if (!fdev) {
         return ENOENT;
     }
 
-    fdev = FUSE_DEVICE_FROM_UNIT_FAST(unit);
-    if (!fdev) {
-        fuse_lck_mtx_unlock(fuse_device_mutex);
-        log("fuse4x: device found with no softc\n");
-        return ENXIO;
-    }
+    /* usecount is protected by fdev->mtx, the device table doesn't need a lock. */
+    fuse_lck_mtx_lock(fdev->mtx);
 
-    fuse_lck_mtx_lock(fuse_device_mutex);
+    if (!fuse_interface_available) {
+        fuse_lck_mtx_unlock(fdev->mtx);
+        return ENOENT;
+    }
 
     if (fdev->usecount != 0) {
-        fuse_lck_mtx_unlock(fuse_device_mutex);
+        fuse_lck_mtx_unlock(fdev->mtx);
         return EBUSY;
     }
 
-    fdev->usecount++;
-
-    fuse_lck_mtx_lock(fdev->mtx);
-
-    fuse_lck_mtx_unlock(fuse_device_mutex);
-
-    /* Could block. */
-    data = fuse_data_alloc(p);
-
     if (fdev->data) {
         /*
          * This slot isn't currently open by a user daemon. However, it was
          * used earlier for a mount that's still lingering, even though the
          * user daemon is dead.
          */
-
-        fuse_lck_mtx_lock(fuse_device_mutex);
-
-        fdev->usecount--;
-
         fuse_lck_mtx_unlock(fdev->mtx);
+        return EBUSY;
+    }
 
-        fuse_lck_mtx_unlock(fuse_device_mutex);
+    fdev->usecount++;
 
-        fuse_data_destroy(data);
+    /* Could block. */
+    data = fuse_data_alloc(p);
 
-        return EBUSY;
-    } else {
-        data->opened = true;
-        data->fdev   = fdev;
-        fdev->data   = data;
-        fdev->pid    = proc_pid(p);
-    }
+    data->opened = true;
+    data->fdev   = fdev;
+    data->channels[0].fdev = fdev;
+    fdev->data    = data;
+    fdev->channel = 0;
+    fdev->pid     = proc_pid(p);
 
     fuse_lck_mtx_unlock(fdev->mtx);
 
+    if (unit / FUSE4X_DEVICE_BATCH == fuse_device_nbatches - 1) {
+        fuse_devices_reserve(unit);
+    }
+
     return KERN_SUCCESS;
 }
 
@@ -171,17 +268,15 @@ fuse_device_close(dev_t dev, __unused int flags, __unused int devtype,
                   __unused struct proc *p)
 {
     int unit;
+    bool last;
     struct fuse_device *fdev;
+    struct fuse_device *primary;
     struct fuse_data   *data;
 
     fuse_trace_printf_func();
 
     unit = minor(dev);
-    if (unit >= FUSE4X_NDEVICES) {
-        return ENOENT;
-    }
-
-    fdev = FUSE_DEVICE_FROM_UNIT_FAST(unit);
+    fdev = fuse_device_from_unit(unit);
     if (!fdev) {
         return ENXIO;
     }
@@ -191,22 +286,42 @@ fuse_device_close(dev_t dev, __unused int flags, __unused int devtype,
         panic("fuse4x: no device private data in device_close");
     }
 
-    fuse_data_kill(data);
+    /*
+     * Closing a clone only takes that channel away. Closing the device the
+     * daemon opened first means the daemon is gone.
+     */
+    if (fdev->channel == 0) {
+        fuse_data_kill(data);
+    }
 
     fuse_lck_mtx_lock(fdev->mtx);
 
-    data->opened = false;
+    primary = data->fdev;
+    if (primary != fdev) {
+        fuse_lck_mtx_lock(primary->mtx);
+    }
 
-    fuse_reject_answers(data);
+    last = fuse_data_detach_channel(data, fdev->channel);
+    if (last) {
+        data->opened = false;
+        fuse_data_kill(data);
+    }
 
-    if (!data->mounted) {
-        /* We're not mounted. Can destroy mpdata. */
-        fuse_device_close_final(fdev);
+    if (last || fdev->channel == 0) {
+        fuse_reject_answers(data);
     }
 
-    fuse_lck_mtx_unlock(fdev->mtx);
+    if (last && !data->mounted) {
+        /* We're not mounted. Can destroy mpdata. */
+        fuse_device_close_final(primary);
+    }
 
-    fuse_lck_mtx_lock(fuse_device_mutex);
+    if (primary != fdev) {
+        fdev->data    = NULL;
+        fdev->channel = 0;
+        fdev->pid     = -1;
+        fuse_lck_mtx_unlock(primary->mtx);
+    }
 
     /*
      * Even if usecount goes 0 here, at open time, we check if fdev->data
@@ -216,7 +331,7 @@ fuse_device_close(dev_t dev, __unused int flags, __unused int devtype,
      */
     fdev->usecount--;
 
-    fuse_lck_mtx_unlock(fuse_device_mutex);
+    fuse_lck_mtx_unlock(fdev->mtx);
 
     return KERN_SUCCESS;
 }
@@ -228,45 +343,78 @@ fuse_device_read(dev_t dev, uio_t uio, int ioflag)
     size_t buflen[3];
     void *buf[] = { NULL, NULL, NULL };
 
-    struct fuse_device *fdev;
-    struct fuse_data   *data;
-    struct fuse_ticket *ticket;
+    struct fuse_device  *fdev;
+    struct fuse_data    *data;
+    struct fuse_channel *chan;
+    struct fuse_ticket  *ticket;
 
     fuse_trace_printf_func();
 
-    fdev = FUSE_DEVICE_FROM_UNIT_FAST(minor(dev));
+    fdev = fuse_device_from_unit(minor(dev));
     if (!fdev) {
         return ENXIO;
     }
 
     data = fdev->data;
+    chan = &data->channels[fdev->channel];
 
-    fuse_lck_mtx_lock(data->ms_mtx);
+    fuse_lck_mtx_lock(chan->ms_mtx);
 
     /* The read loop (outgoing messages to the user daemon). */
 
 again:
     if (data->dead) {
-        fuse_lck_mtx_unlock(data->ms_mtx);
+        fuse_lck_mtx_unlock(chan->ms_mtx);
         return ENODEV;
     }
 
-    if ((ticket = STAILQ_FIRST(&data->ms_head))) {
-        STAILQ_REMOVE_HEAD(&data->ms_head, ms_link);
+    /* Late arrivals get their fair share too, so always look at them. */
+    fuse_channel_collect(chan);
+
+    if ((ticket = fuse_channel_dequeue(data, chan))) {
+
+        /* Hand the rest of a burst to another sleeping reader. */
+        if (!fuse_channel_empty(chan) && chan->ms_sleepers > chan->ms_woken) {
+            chan->ms_woken++;
+            fuse_wakeup_one((caddr_t)chan);
+        }
     } else {
         if (ioflag & IO_NDELAY) {
-            fuse_lck_mtx_unlock(data->ms_mtx);
+            fuse_lck_mtx_unlock(chan->ms_mtx);
             return EAGAIN;
         }
-        err = fuse_msleep(data, data->ms_mtx, PCATCH, "fu_msg", NULL);
+
+        /*
+         * Requesters only take ms_mtx to wake us when they see a sleeper, so
+         * announce ourselves before the last look at the queue.
+         */
+        chan->ms_sleepers++;
+        OSMemoryBarrier();
+        fuse_channel_collect(chan);
+        if (!fuse_channel_empty(chan)) {
+            chan->ms_sleepers--;
+            goto again;
+        }
+
+        err = fuse_msleep(chan, chan->ms_mtx, PCATCH, "fu_msg", NULL);
+        chan->ms_sleepers--;
+        if (chan->ms_woken) {
+            chan->ms_woken--;
+        }
+
+        /*
+         * A requester that still saw us as woken up left its message for
+         * us, so the queue has to be read after the counts are updated.
+         */
+        OSMemoryBarrier();
         if (err) {
-            fuse_lck_mtx_unlock(data->ms_mtx);
+            fuse_lck_mtx_unlock(chan->ms_mtx);
             return (data->dead ? ENODEV : err);
         }
         goto again;
     }
 
-    fuse_lck_mtx_unlock(data->ms_mtx);
+    fuse_lck_mtx_unlock(chan->ms_mtx);
 
     if (data->dead) {
          if (ticket) {
@@ -275,6 +423,8 @@ again:
          return ENODEV;
     }
 
+    fuse_trace_ticket(ticket, FUSE4X_TRACE_DEQUEUE, 0);
+
     switch (ticket->ms_type) {
 
     case FT_M_FIOV:
@@ -307,6 +457,11 @@ again:
         }
     }
 
+    if (!err) {
+        fuse_capture_message(data, FUSE4X_CAPTURE_REQUEST, buf[0], buflen[0],
+                             (uint32_t)(buflen[0] + (buf[1] ? buflen[1] : 0)));
+    }
+
     /*
      * XXX: Stop gap! I really need to finish interruption plumbing.
      */
@@ -339,7 +494,7 @@ fuse_device_write(dev_t dev, uio_t uio, __unused int ioflag)
 
     fuse_trace_printf_func();
 
-    fdev = FUSE_DEVICE_FROM_UNIT_FAST(minor(dev));
+    fdev = fuse_device_from_unit(minor(dev));
     if (!fdev) {
         return ENXIO;
     }
@@ -361,6 +516,13 @@ fuse_device_write(dev_t dev, uio_t uio, __unused int ioflag)
         return EINVAL;
     }
 
+    fuse_capture_message(fdev->data, FUSE4X_CAPTURE_REPLY, &ohead, sizeof(ohead), ohead.len);
+
+    if (ohead.unique == 0) {
+        /* Unsolicited notification; the error field holds its code. */
+        return fuse_internal_notify(fdev->data, ohead.error, uio);
+    }
+
     if (uio_resid(uio) && ohead.error) {
         log("fuse4x: non-zero error for a message with a body\n");
         return EINVAL;
@@ -374,6 +536,8 @@ fuse_device_write(dev_t dev, uio_t uio, __unused int ioflag)
 
     fuse_lck_mtx_lock(data->aw_mtx);
 
+    fuse_collect_requests(data);
+
     TAILQ_FOREACH_SAFE(ticket, &data->aw_head, aw_link, x_ticket) {
         if (ticket->unique == ohead.unique) {
             found = true;
@@ -385,6 +549,8 @@ fuse_device_write(dev_t dev, uio_t uio, __unused int ioflag)
     fuse_lck_mtx_unlock(data->aw_mtx);
 
     if (found) {
+        fuse_trace_ticket(ticket, FUSE4X_TRACE_REPLY, ohead.error);
+
         if (ticket->aw_callback) {
             memcpy(&ticket->aw_ohead, &ohead, sizeof(ohead));
             err = ticket->aw_callback(ticket, uio);
@@ -399,58 +565,252 @@ fuse_device_write(dev_t dev, uio_t uio, __unused int ioflag)
     return err;
 }
 
+/*
+ * Turns the freshly opened device fdev into an extra channel of the file
+ * system served through /dev/fuse4x<unit>. The clone has to be set up
+ * before the daemon does any other I/O on the new descriptor.
+ */
+static int
+fuse_device_clone(fuse_device_t fdev, uint32_t unit)
+{
+    int err = 0;
+    int channel;
+
+    struct fuse_device *target;
+    struct fuse_data   *data;
+    struct fuse_data   *fresh;
+
+    target = fuse_device_from_unit((int)unit);
+    if (!target || target == fdev) {
+        return EINVAL;
+    }
+
+    /* fuse_device_mutex keeps two devices from cloning onto each other. */
+    fuse_lck_mtx_lock(fuse_device_mutex);
+    fuse_lck_mtx_lock(fdev->mtx);
+    fuse_lck_mtx_lock(target->mtx);
+
+    fresh = fdev->data;
+    data = target->data;
+
+    if (!fresh || fdev->channel != 0 || fresh->mounted ||
+        fresh->channel_slots > 1) {
+        err = EINVAL;
+        goto out;
+    }
+
+    if (!data || target->channel != 0 || !data->opened || data->dead) {
+        err = ENXIO;
+        goto out;
+    }
+
+    if (fuse_match_cred(data->daemoncred, fresh->daemoncred)) {
+        err = EPERM;
+        goto out;
+    }
+
+    channel = fuse_data_attach_channel(data, fdev);
+    if (channel < 0) {
+        err = EBUSY;
+        goto out;
+    }
+
+    fdev->data    = data;
+    fdev->channel = channel;
+
+out:
+    fuse_lck_mtx_unlock(target->mtx);
+    fuse_lck_mtx_unlock(fdev->mtx);
+    fuse_lck_mtx_unlock(fuse_device_mutex);
+
+    if (!err) {
+        /* The data allocated at open time is not needed anymore. */
+        fuse_data_destroy(fresh);
+    }
+
+    return err;
+}
+
+/*
+ * Runs a trace or capture request for the file system served through
+ * /dev/fuse4x<unit>. Only its daemon's user may look.
+ */
+static int
+fuse_device_trace(u_long cmd, caddr_t udata)
+{
+    int err;
+    uint32_t unit = *(uint32_t *)udata; /* both requests start with the unit */
+    struct fuse_device *target;
+    struct fuse_data   *data;
+
+    target = fuse_device_from_unit((int)unit);
+    if (!target) {
+        return EINVAL;
+    }
+
+    fuse_lck_mtx_lock(target->mtx);
+
+    data = target->data;
+    if (!data || target->channel != 0 || !data->opened) {
+        err = ENXIO;
+    } else if (fuse_match_cred(data->daemoncred, kauth_cred_get()) &&
+               !kauth_cred_issuser(kauth_cred_get())) {
+        err = EPERM;
+    } else {
+        switch (cmd) {
+        case FUSEDEVIOCTRACESET:
+            err = fuse_ring_setup(&data->trace, sizeof(struct fuse_trace_record),
+                                  ((struct fuse_trace_setup *)udata)->nrecords,
+                                  FUSE4X_TRACE_MAX_RECORDS);
+            break;
+        case FUSEDEVIOCTRACEREAD:
+            err = fuse_ring_read(&data->trace, (struct fuse_trace_read *)udata,
+                                 target->mtx);
+            break;
+        case FUSEDEVIOCCAPTURESET:
+            err = fuse_ring_setup(&data->capture, sizeof(struct fuse_capture_record),
+                                  ((struct fuse_trace_setup *)udata)->nrecords,
+                                  FUSE4X_CAPTURE_MAX_RECORDS);
+            break;
+        default:
+            err = fuse_ring_read(&data->capture, (struct fuse_trace_read *)udata,
+                                 target->mtx);
+            break;
+        }
+    }
+
+    fuse_lck_mtx_unlock(target->mtx);
+
+    return err;
+}
+
+/* Sets the fair queuing weight of a process on all channels of the mount. */
+static int
+fuse_device_set_weight(fuse_device_t fdev, struct fuse_flow_weight *fw)
+{
+    struct fuse_data *data;
+
+    if (fw->weight < 1 || fw->weight > FUSE4X_FAIR_MAX_WEIGHT) {
+        return EINVAL;
+    }
+
+    fuse_lck_mtx_lock(fdev->mtx);
+
+    data = fdev->data;
+    if (!data) {
+        fuse_lck_mtx_unlock(fdev->mtx);
+        return ENXIO;
+    }
+
+    data->flow_weights[(uint32_t)fw->pid % FUSE4X_FAIR_FLOWS] = fw->weight;
+
+    fuse_lck_mtx_unlock(fdev->mtx);
+
+    return 0;
+}
+
+/* Adds up the fair queuing counters of all channels of the mount. */
+static int
+fuse_device_get_flows(fuse_device_t fdev, struct fuse_flows *out)
+{
+    int i, j;
+    struct fuse_data    *data;
+    struct fuse_channel *chan;
+    struct fuse_flow    *flow;
+
+    bzero(out, sizeof(*out));
+
+    fuse_lck_mtx_lock(fdev->mtx);
+
+    data = fdev->data;
+    if (!data) {
+        fuse_lck_mtx_unlock(fdev->mtx);
+        return ENXIO;
+    }
+
+    for (i = 0; i < FUSE4X_MAX_CHANNELS; i++) {
+        chan = &data->channels[i];
+        fuse_lck_mtx_lock(chan->ms_mtx);
+        for (j = 0; j < FUSE4X_FAIR_FLOWS; j++) {
+            flow = &chan->ms_flows[j];
+            if (flow->served || flow->queued) {
+                out->flows[j].pid = flow->pid;
+            }
+            out->flows[j].queued += flow->queued;
+            out->flows[j].served += flow->served;
+        }
+        fuse_lck_mtx_unlock(chan->ms_mtx);
+    }
+
+    for (j = 0; j < FUSE4X_FAIR_FLOWS; j++) {
+        out->flows[j].weight = data->flow_weights[j];
+    }
+
+    fuse_lck_mtx_unlock(fdev->mtx);
+
+    return 0;
+}
+
 int
-fuse_devices_start(void)
+fuse_device_ioctl(dev_t dev, u_long cmd, caddr_t udata,
+                  __unused int flags, __unused struct proc *p)
 {
-    int i = 0;
+    struct fuse_device *fdev;
 
     fuse_trace_printf_func();
 
-    bzero((void *)fuse_device_table, sizeof(fuse_device_table));
+    fdev = fuse_device_get(dev);
+    if (!fdev) {
+        return ENXIO;
+    }
 
-    if ((fuse_cdev_major = cdevsw_add(-1, &fuse_device_cdevsw)) == -1) {
-        goto error;
-    }
-
-    for (i = 0; i < FUSE4X_NDEVICES; i++) {
-
-        dev_t dev = makedev(fuse_cdev_major, i);
-        fuse_device_table[i].cdev = devfs_make_node(
-                                        dev,
-                                        DEVFS_CHAR,
-                                        UID_ROOT,
-                                        GID_OPERATOR,
-                                        0666,
-                                        FUSE4X_DEVICE_BASENAME "%d",
-                                        i);
-        if (fuse_device_table[i].cdev == NULL) {
-            goto error;
-        }
+    switch (cmd) {
+    case FUSEDEVIOCCLONE:
+        return fuse_device_clone(fdev, *(uint32_t *)udata);
+
+    case FUSEDEVIOCSETWEIGHT:
+        return fuse_device_set_weight(fdev, (struct fuse_flow_weight *)udata);
 
-        fuse_device_table[i].data     = NULL;
-        fuse_device_table[i].dev      = dev;
-        fuse_device_table[i].pid      = -1;
-        fuse_device_table[i].usecount = 0;
-        fuse_device_table[i].mtx      = lck_mtx_alloc_init(fuse_lock_group,
-                                                           fuse_lock_attr);
+    case FUSEDEVIOCGETFLOWS:
+        return fuse_device_get_flows(fdev, (struct fuse_flows *)udata);
+
+    case FUSEDEVIOCTRACESET:
+    case FUSEDEVIOCTRACEREAD:
+    case FUSEDEVIOCCAPTURESET:
+    case FUSEDEVIOCCAPTUREREAD:
+        return fuse_device_trace(cmd, udata);
+
+    default:
+        return ENOTTY;
     }
+}
 
-    fuse_interface_available = true;
+int
+fuse_devices_start(void)
+{
+    fuse_trace_printf_func();
 
-    return KERN_SUCCESS;
+    bzero((void *)fuse_device_table, sizeof(fuse_device_table));
+    fuse_device_nbatches = 0;
+
+    if ((fuse_cdev_major = cdevsw_add(-1, &fuse_device_cdevsw)) == -1) {
+        return KERN_FAILURE;
+    }
+
+    fuse_lck_mtx_lock(fuse_device_mutex);
 
-error:
-    for (--i; i >= 0; i--) {
-        devfs_remove(fuse_device_table[i].cdev);
-        fuse_device_table[i].cdev = NULL;
-        fuse_device_table[i].dev  = 0;
-        lck_mtx_free(fuse_device_table[i].mtx, fuse_lock_group);
+    if (fuse_devices_grow()) {
+        fuse_lck_mtx_unlock(fuse_device_mutex);
+        (void)cdevsw_remove(fuse_cdev_major, &fuse_device_cdevsw);
+        fuse_cdev_major = -1;
+        return KERN_FAILURE;
     }
 
-    (void)cdevsw_remove(fuse_cdev_major, &fuse_device_cdevsw);
-    fuse_cdev_major = -1;
+    fuse_interface_available = true;
+
+    fuse_lck_mtx_unlock(fuse_device_mutex);
 
-    return KERN_FAILURE;
+    return KERN_SUCCESS;
 }
 
 int
@@ -460,49 +820,54 @@ fuse_devices_stop(void)
 
     fuse_trace_printf_func();
 
-    fuse_interface_available = false;
-
     fuse_lck_mtx_lock(fuse_device_mutex);
 
+    fuse_interface_available = false;
+
     if (fuse_cdev_major == -1) {
         fuse_lck_mtx_unlock(fuse_device_mutex);
         return KERN_SUCCESS;
     }
 
-    for (i = 0; i < FUSE4X_NDEVICES; i++) {
+    for (i = 0; i < fuse_device_nbatches * FUSE4X_DEVICE_BATCH; i++) {
 
         char p_comm[MAXCOMLEN + 1] = { '?', '\0' };
+        struct fuse_device *fdev = fuse_device_from_unit(i);
+        bool busy;
+        bool lingering;
+
+        fuse_lck_mtx_lock(fdev->mtx);
+        busy = (fdev->usecount != 0);
+        lingering = (fdev->data != NULL);
+        fuse_lck_mtx_unlock(fdev->mtx);
 
-        if (fuse_device_table[i].usecount != 0) {
+        if (busy) {
             fuse_interface_available = true;
             fuse_lck_mtx_unlock(fuse_device_mutex);
-            proc_name(fuse_device_table[i].pid, p_comm, MAXCOMLEN + 1);
+            proc_name(fdev->pid, p_comm, MAXCOMLEN + 1);
             log("fuse4x: /dev/fuse4x%d is still active (pid=%d %s)\n",
-                  i, fuse_device_table[i].pid, p_comm);
+                  i, fdev->pid, p_comm);
             return KERN_FAILURE;
         }
 
-        if (fuse_device_table[i].data != NULL) {
+        if (lingering) {
             fuse_interface_available = true;
             fuse_lck_mtx_unlock(fuse_device_mutex);
-            proc_name(fuse_device_table[i].pid, p_comm, MAXCOMLEN + 1);
+            proc_name(fdev->pid, p_comm, MAXCOMLEN + 1);
             /* The pid can't possibly be active here. */
             log("fuse4x: /dev/fuse4x%d has a lingering mount (pid=%d, %s)\n",
-                  i, fuse_device_table[i].pid, p_comm);
+                  i, fdev->pid, p_comm);
             return KERN_FAILURE;
         }
     }
 
     /* No device is in use. */
 
-    for (i = 0; i < FUSE4X_NDEVICES; i++) {
-        devfs_remove(fuse_device_table[i].cdev);
-        lck_mtx_free(fuse_device_table[i].mtx, fuse_lock_group);
-        fuse_device_table[i].cdev   = NULL;
-        fuse_device_table[i].dev    = 0;
-        fuse_device_table[i].pid    = -1;
-        fuse_device_table[i].mtx    = NULL;
+    for (i = 0; i < fuse_device_nbatches; i++) {
+        fuse_devices_free_batch(fuse_device_table[i], FUSE4X_DEVICE_BATCH);
+        fuse_device_table[i] = NULL;
     }
+    fuse_device_nbatches = 0;
 
     ret = cdevsw_remove(fuse_cdev_major, &fuse_device_cdevsw);
     if (ret != fuse_cdev_major) {
@@ -528,7 +893,7 @@ fuse_device_kill(int unit, struct proc *p)
         return EINVAL;
     }
 
-    fdev = FUSE_DEVICE_FROM_UNIT_FAST(unit);
+    fdev = fuse_device_from_unit(unit);
     if (!fdev) {
         return ENOENT;
     }
@@ -571,7 +936,7 @@ fuse_device_print_vnodes(int unit_flags, struct proc *p)
         return EINVAL;
     }
 
-    fdev = FUSE_DEVICE_FROM_UNIT_FAST(unit);
+    fdev = fuse_device_from_unit(unit);
     if (!fdev) {
         return ENOENT;
     }
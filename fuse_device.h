@@ -21,6 +21,7 @@ struct fuse_device {
     dev_t             dev;
     void             *cdev;
     struct fuse_data *data;
+    int               channel; // index of this device in data->channels
 };
 typedef struct fuse_device * fuse_device_t;
 
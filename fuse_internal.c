@@ -47,6 +47,81 @@
 
 /* access */
 
+/*
+ * Looks for an earlier FUSE_ACCESS answer given to cred for vp. An answer
+ * is good for as long as the attributes it was given with: it runs out with
+ * attr_valid and goes away with fuse_invalidate_attr. A grant for a wider
+ * mask also covers a narrower one.
+ */
+static bool
+fuse_internal_access_cached(vnode_t vp, kauth_cred_t cred, uint32_t mask, int *errp)
+{
+    bool hit = false;
+    struct timespec uptsp;
+    struct fuse_vnode_data *fvdat = VTOFUD(vp);
+    struct fuse_data *data = fuse_get_mpdata(vnode_mount(vp));
+
+    nanouptime(&uptsp);
+
+    fuse_lck_mtx_lock(data->node_mtx);
+
+    for (int i = 0; i < FUSE_ACCESS_CACHE_SIZE; i++) {
+        struct fuse_access_entry *fae = &fvdat->access_cache[i];
+
+        if (fae->cred != cred || fae->epoch != fvdat->attr_epoch ||
+            fuse_timespec_cmp(&uptsp, &fae->expires, >=)) {
+            continue;
+        }
+
+        if (fae->mask == mask ||
+            (fae->err == 0 && (fae->mask & mask) == mask)) {
+            *errp = fae->err;
+            hit = true;
+            break;
+        }
+    }
+
+    fuse_lck_mtx_unlock(data->node_mtx);
+
+    return hit;
+}
+
+static void
+fuse_internal_access_remember(vnode_t vp, kauth_cred_t cred, uint32_t mask, int err)
+{
+    struct timespec uptsp;
+    struct fuse_access_entry *fae;
+    kauth_cred_t oldcred;
+    struct fuse_vnode_data *fvdat = VTOFUD(vp);
+    struct fuse_data *data = fuse_get_mpdata(vnode_mount(vp));
+
+    nanouptime(&uptsp);
+    if (fuse_timespec_cmp(&uptsp, &fvdat->attr_valid, >=)) {
+        /* The daemon doesn't let us cache attributes, or they are stale. */
+        return;
+    }
+
+    kauth_cred_ref(cred);
+
+    fuse_lck_mtx_lock(data->node_mtx);
+
+    fae = &fvdat->access_cache[fvdat->access_next];
+    fvdat->access_next = (fvdat->access_next + 1) % FUSE_ACCESS_CACHE_SIZE;
+
+    oldcred = fae->cred;
+    fae->cred = cred;
+    fae->mask = mask;
+    fae->err = err;
+    fae->epoch = fvdat->attr_epoch;
+    fae->expires = fvdat->attr_valid;
+
+    fuse_lck_mtx_unlock(data->node_mtx);
+
+    if (oldcred) {
+        kauth_cred_unref(&oldcred);
+    }
+}
+
 __private_extern__
 int
 fuse_internal_access(vnode_t                   vp,
@@ -57,6 +132,8 @@ fuse_internal_access(vnode_t                   vp,
     uint32_t mask = 0;
     int dataflags;
     mount_t mp;
+    uint32_t epoch;
+    kauth_cred_t cred;
     struct fuse_dispatcher fdi;
     struct fuse_access_in *fai;
     struct fuse_data      *data;
@@ -117,6 +194,16 @@ fuse_internal_access(vnode_t                   vp,
         mask |= W_OK;
     }
 
+    cred = vfs_context_ucred(context);
+    if (fuse_internal_access_cached(vp, cred, mask, &err)) {
+        OSIncrementAtomic((SInt32 *)&fuse_access_cache_hits);
+        return err;
+    }
+    OSIncrementAtomic((SInt32 *)&fuse_access_cache_misses);
+
+    /* An invalidation while the upcall is out makes the answer unusable. */
+    epoch = VTOFUD(vp)->attr_epoch;
+
     bzero(&fdi, sizeof(fdi));
 
     fuse_dispatcher_init(&fdi, sizeof(*fai));
@@ -130,6 +217,11 @@ fuse_internal_access(vnode_t                   vp,
         fuse_ticket_drop(fdi.ticket);
     }
 
+    if ((err == 0 || err == EACCES || err == EPERM) &&
+        epoch == VTOFUD(vp)->attr_epoch) {
+        fuse_internal_access_remember(vp, cred, mask, err);
+    }
+
     if (err == ENOSYS) {
         /*
          * Make sure we don't come in here again.
@@ -327,14 +419,383 @@ fuse_internal_fsync(vnode_t                 vp,
             fuse_ticket_drop(dispatcher->ticket);
         }
     } else {
-        fuse_insert_callback(dispatcher->ticket, fuse_internal_fsync_callback);
-        fuse_insert_message(dispatcher->ticket);
+        fuse_insert_request(dispatcher->ticket, fuse_internal_fsync_callback);
+    }
+
+out:
+    return err;
+}
+
+/* attribute prefetch */
+
+static __inline__
+struct fuse_vnode_data *
+fuse_internal_attr_prefetch_find(struct fuse_data *data, uint64_t nodeid)
+{
+    struct fuse_vnode_data tt = {
+        .nodeid = nodeid
+    };
+
+    return RB_FIND(fuse_data_nodes, &data->nodes_head, &tt);
+}
+
+static int
+fuse_internal_attr_prefetch_callback(struct fuse_ticket *ticket, uio_t uio)
+{
+    int err;
+    struct fuse_data       *data = ticket->data;
+    struct fuse_attr_out   *fao  = NULL;
+    struct fuse_vnode_data *fvdat;
+    struct timespec         uptsp;
+
+    uint64_t nodeid = ((struct fuse_in_header *)ticket->ms_fiov.base)->nodeid;
+
+    err = ticket->aw_ohead.error;
+    if (!err) {
+        err = fuse_ticket_pull(ticket, uio);
+    }
+    if (!err) {
+        fao = ticket->aw_fiov.base;
+        if ((fao->attr.mode & S_IFMT) == 0) {
+            err = EIO;
+        }
+    }
+
+    fuse_lck_mtx_lock(data->node_mtx);
+
+    fvdat = fuse_internal_attr_prefetch_find(data, nodeid);
+    if (fvdat && fvdat->prefetch_state == FN_PREFETCH_PENDING) {
+        if (!err && fvdat->attr_epoch != ticket->attr_epoch) {
+            /* The node changed while the GETATTR was out. */
+            OSIncrementAtomic((SInt32 *)&fuse_attr_prefetch_wasted);
+            err = ESTALE;
+        }
+        if (err) {
+            fvdat->prefetch_state = FN_PREFETCH_NONE;
+        } else {
+            fvdat->prefetch_attr = fao->attr;
+            fvdat->prefetch_epoch = ticket->attr_epoch;
+            /* XXX: truncation; user space sends us a 64-bit tv_sec */
+            fvdat->prefetch_valid.tv_sec = (time_t)fao->attr_valid;
+            fvdat->prefetch_valid.tv_nsec = fao->attr_valid_nsec;
+            nanouptime(&uptsp);
+            fuse_timespec_add(&fvdat->prefetch_valid, &uptsp);
+            fvdat->prefetch_state = FN_PREFETCH_DONE;
+        }
+    } else if (!err) {
+        /* The node is gone or has fetched its attributes by itself. */
+        OSIncrementAtomic((SInt32 *)&fuse_attr_prefetch_wasted);
+    }
+
+    fuse_lck_mtx_unlock(data->node_mtx);
+
+    fuse_ticket_drop(ticket);
+
+    return 0;
+}
+
+/*
+ * Called on every attribute cache miss. Tools like "ls -l" stat all the
+ * children of a directory one after another. Once a few distinct siblings
+ * have missed in a row, GETATTRs for the siblings that follow in the node
+ * tree are sent ahead without waiting for the answers, which get parked in
+ * the nodes until fuse_internal_attr_prefetched() picks them up.
+ */
+__private_extern__
+void
+fuse_internal_attr_prefetch(vnode_t vp, vfs_context_t context)
+{
+    int i;
+    int ntargets = 0;
+    uint32_t nsiblings = 0;
+    uint32_t scanned = 0;
+    uint32_t window = fuse_attr_prefetch_window;
+    uint64_t targets[FUSE_MAX_ATTR_PREFETCH_WINDOW];
+    uint32_t epochs[FUSE_MAX_ATTR_PREFETCH_WINDOW];
+    struct timespec uptsp;
+    struct timespec idle;
+
+    struct fuse_vnode_data *fvdat = VTOFUD(vp);
+    struct fuse_vnode_data *dfvdat;
+    struct fuse_vnode_data *sibling;
+
+    mount_t mp = vnode_mount(vp);
+    struct fuse_data *data = fuse_get_mpdata(mp);
+
+    if (window == 0 || fvdat->parent_nodeid == FUSE_NULL_ID ||
+        fuse_isnoattrcache_mp(mp)) {
+        return;
+    }
+
+    if (window > FUSE_MAX_ATTR_PREFETCH_WINDOW) {
+        window = FUSE_MAX_ATTR_PREFETCH_WINDOW;
+    }
+
+    nanouptime(&uptsp);
+
+    fuse_lck_mtx_lock(data->node_mtx);
+
+    dfvdat = fuse_internal_attr_prefetch_find(data, fvdat->parent_nodeid);
+    if (!dfvdat) {
+        goto out;
+    }
+
+    /* A directory that has been quiet for a second starts over. */
+    idle = dfvdat->prefetch_time;
+    idle.tv_sec++;
+    if (fuse_timespec_cmp(&uptsp, &idle, >)) {
+        dfvdat->prefetch_streak = 0;
+    }
+    dfvdat->prefetch_time = uptsp;
+
+    if (dfvdat->prefetch_lastchild != fvdat->nodeid) {
+        dfvdat->prefetch_lastchild = fvdat->nodeid;
+        dfvdat->prefetch_streak++;
+    }
+
+    if (dfvdat->prefetch_streak < fuse_attr_prefetch_trigger) {
+        goto out;
+    }
+
+    /*
+     * Keep "window" siblings ahead of the current one covered. The walk is
+     * bounded since siblings needn't be next to each other in the tree.
+     */
+    for (sibling = RB_NEXT(fuse_data_nodes, &data->nodes_head, fvdat);
+         sibling && nsiblings < window && scanned < window * 4;
+         sibling = RB_NEXT(fuse_data_nodes, &data->nodes_head, sibling), scanned++) {
+
+        if (sibling->parent_nodeid != dfvdat->nodeid) {
+            continue;
+        }
+
+        nsiblings++;
+
+        if (sibling->prefetch_state != FN_PREFETCH_NONE ||
+            fuse_timespec_cmp(&uptsp, &sibling->attr_valid, <=)) {
+            continue;
+        }
+
+        sibling->prefetch_state = FN_PREFETCH_PENDING;
+        epochs[ntargets] = sibling->attr_epoch;
+        targets[ntargets++] = sibling->nodeid;
     }
 
 out:
+    fuse_lck_mtx_unlock(data->node_mtx);
+
+    for (i = 0; i < ntargets; i++) {
+        struct fuse_dispatcher fdi;
+
+        fuse_dispatcher_init(&fdi, sizeof(struct fuse_getattr_in));
+        fuse_dispatcher_make(&fdi, FUSE_GETATTR, mp, targets[i], context);
+        bzero(fdi.indata, sizeof(struct fuse_getattr_in));
+        fdi.ticket->attr_epoch = epochs[i];
+
+        fuse_insert_request(fdi.ticket, fuse_internal_attr_prefetch_callback);
+    }
+}
+
+/*
+ * Hands over the attributes prefetched for vp. Returns true and fills in fao
+ * if they are there and still valid.
+ */
+__private_extern__
+bool
+fuse_internal_attr_prefetched(vnode_t vp, struct fuse_attr_out *fao)
+{
+    bool hit = false;
+    struct timespec uptsp;
+    struct fuse_vnode_data *fvdat = VTOFUD(vp);
+    struct fuse_data *data = fuse_get_mpdata(vnode_mount(vp));
+
+    fuse_lck_mtx_lock(data->node_mtx);
+
+    if (fvdat->prefetch_state == FN_PREFETCH_DONE) {
+        nanouptime(&uptsp);
+        if (fvdat->prefetch_epoch == fvdat->attr_epoch &&
+            fuse_timespec_cmp(&uptsp, &fvdat->prefetch_valid, <)) {
+            struct timespec left = fvdat->prefetch_valid;
+            fuse_timespec_sub(&left, &uptsp);
+
+            bzero(fao, sizeof(*fao));
+            fao->attr_valid = left.tv_sec;
+            fao->attr_valid_nsec = (uint32_t)left.tv_nsec;
+            fao->attr = fvdat->prefetch_attr;
+
+            hit = true;
+            OSIncrementAtomic((SInt32 *)&fuse_attr_prefetch_hits);
+        } else {
+            OSIncrementAtomic((SInt32 *)&fuse_attr_prefetch_wasted);
+        }
+    }
+
+    /* An answer that is still on its way will be counted as wasted. */
+    fvdat->prefetch_state = FN_PREFETCH_NONE;
+
+    fuse_lck_mtx_unlock(data->node_mtx);
+
+    return hit;
+}
+
+/* single-flight */
+
+static struct fuse_flight *
+fuse_internal_flight_find(struct fuse_data *data, uint32_t opcode,
+                          uint64_t nodeid, const char *name, size_t namelen,
+                          uid_t uid)
+{
+    struct fuse_flight *flight;
+
+    LIST_FOREACH(flight, &data->flights, link) {
+        if (flight->opcode == opcode && flight->nodeid == nodeid &&
+            flight->uid == uid && flight->namelen == namelen &&
+            memcmp(flight->name, name, namelen) == 0) {
+            return flight;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Returns the flight for the given question with a reference held, or NULL
+ * if the caller should just go ahead on its own. Answers may depend on who
+ * asks, so only callers with the same uid share a flight. If *leader is set
+ * the caller has to send the upcall and call fuse_internal_flight_land(),
+ * otherwise it waits for the answer with fuse_internal_flight_wait().
+ */
+__private_extern__
+struct fuse_flight *
+fuse_internal_flight_join(struct fuse_data *data, uint32_t opcode,
+                          uint64_t nodeid, const char *name, size_t namelen,
+                          vfs_context_t context, bool *leader)
+{
+    struct fuse_flight *flight;
+    struct fuse_flight *fresh;
+    uid_t uid = kauth_cred_getuid(vfs_context_ucred(context));
+
+    if (namelen > FUSE_MAXNAMLEN) {
+        return NULL;
+    }
+
+    fuse_lck_mtx_lock(data->node_mtx);
+    flight = fuse_internal_flight_find(data, opcode, nodeid, name, namelen, uid);
+    if (flight) {
+        flight->refs++;
+        fuse_lck_mtx_unlock(data->node_mtx);
+        OSIncrementAtomic((SInt32 *)&fuse_upcalls_coalesced);
+        *leader = false;
+        return flight;
+    }
+    fuse_lck_mtx_unlock(data->node_mtx);
+
+    fresh = FUSE_OSMalloc(sizeof(*fresh), fuse_malloc_tag);
+    if (!fresh) {
+        return NULL;
+    }
+    fresh->opcode  = opcode;
+    fresh->nodeid  = nodeid;
+    fresh->uid     = uid;
+    fresh->namelen = namelen;
+    memcpy(fresh->name, name, namelen);
+    fresh->name[namelen] = '\0';
+    fresh->refs    = 1;
+    fresh->done    = false;
+    fresh->err     = 0;
+
+    /* Someone may have taken off while we were allocating. */
+    fuse_lck_mtx_lock(data->node_mtx);
+    flight = fuse_internal_flight_find(data, opcode, nodeid, name, namelen, uid);
+    if (flight) {
+        flight->refs++;
+        *leader = false;
+    } else {
+        LIST_INSERT_HEAD(&data->flights, fresh, link);
+        flight = fresh;
+        fresh = NULL;
+        *leader = true;
+    }
+    fuse_lck_mtx_unlock(data->node_mtx);
+
+    if (fresh) {
+        FUSE_OSFree(fresh, sizeof(*fresh), fuse_malloc_tag);
+        OSIncrementAtomic((SInt32 *)&fuse_upcalls_coalesced);
+    }
+
+    return flight;
+}
+
+/*
+ * Sleeps until the leader lands the flight and returns its error. EAGAIN
+ * means the leader gave up without an answer and the follower should ask
+ * the daemon by itself. The answer is valid until fuse_internal_flight_put().
+ */
+__private_extern__
+int
+fuse_internal_flight_wait(struct fuse_data *data, struct fuse_flight *flight)
+{
+    int err = 0;
+
+#ifdef FUSE4X_ENABLE_BIGLOCK
+    fuse_biglock_unlock(data->biglock);
+#endif
+    fuse_lck_mtx_lock(data->node_mtx);
+    while (!flight->done && !err) {
+        err = fuse_msleep(flight, data->node_mtx, PCATCH, "fu_flight", NULL);
+    }
+    if (flight->done) {
+        err = flight->err;
+    } else if (err == ERESTART) {
+        err = EINTR;
+    }
+    fuse_lck_mtx_unlock(data->node_mtx);
+#ifdef FUSE4X_ENABLE_BIGLOCK
+    fuse_biglock_lock(data->biglock);
+#endif
+
     return err;
 }
 
+/*
+ * Called by the leader once the answer (if any) has been filled in. The
+ * flight is taken off the list, so later callers ask the daemon afresh.
+ */
+__private_extern__
+void
+fuse_internal_flight_land(struct fuse_data *data, struct fuse_flight *flight,
+                          int err)
+{
+    if (err == EINTR || err == ERESTART) {
+        /* The leader was interrupted, not the followers. */
+        err = EAGAIN;
+    }
+
+    fuse_lck_mtx_lock(data->node_mtx);
+    LIST_REMOVE(flight, link);
+    flight->err  = err;
+    flight->done = true;
+    fuse_wakeup(flight);
+    fuse_lck_mtx_unlock(data->node_mtx);
+
+    fuse_internal_flight_put(data, flight);
+}
+
+__private_extern__
+void
+fuse_internal_flight_put(struct fuse_data *data, struct fuse_flight *flight)
+{
+    uint32_t refs;
+
+    fuse_lck_mtx_lock(data->node_mtx);
+    refs = --flight->refs;
+    fuse_lck_mtx_unlock(data->node_mtx);
+
+    if (refs == 0) {
+        FUSE_OSFree(flight, sizeof(*flight), fuse_malloc_tag);
+    }
+}
+
 /* getattr sidekicks */
 __private_extern__
 int
@@ -563,22 +1024,216 @@ fuse_internal_attr_vat2fsai(mount_t                 mp,
     return sizechanged;
 }
 
+/*
+ * Tells the daemon the mtime that cached writes gave vp. Call this after the
+ * dirty pages have been pushed, or the daemon will bump mtime again when they
+ * arrive.
+ */
+__private_extern__
+int
+fuse_internal_attr_flush_mtime(vnode_t vp, vfs_context_t context)
+{
+    int err;
+    struct fuse_dispatcher  fdi;
+    struct fuse_setattr_in *fsai;
+    struct fuse_vnode_data *fvdat = VTOFUD(vp);
+
+    if (!(fvdat->flag & FN_MTIME_DIRTY)) {
+        return 0;
+    }
+
+    fuse_dispatcher_init(&fdi, sizeof(*fsai));
+    fuse_dispatcher_make_vp(&fdi, FUSE_SETATTR, vp, context);
+    fsai = fdi.indata;
+    bzero(fsai, sizeof(*fsai));
+    fsai->valid = FATTR_MTIME;
+    fsai->mtime = fvdat->modify_time.tv_sec;
+    fsai->mtimensec = (uint32_t)fvdat->modify_time.tv_nsec;
+
+    fvdat->flag &= ~FN_MTIME_DIRTY;
+
+    if ((err = fuse_dispatcher_wait_answer(&fdi))) {
+        fuse_invalidate_attr(vp);
+        return err;
+    }
+
+    cache_attrs(vp, (struct fuse_attr_out *)fdi.answer);
+    fuse_ticket_drop(fdi.ticket);
+
+    return 0;
+}
+
 
 /* readdir */
 
+/*
+ * Decides whether readdir may be served from the pages cached for vp. The
+ * daemon vouches for them with FOPEN_KEEP_CACHE on OPENDIR; on auto_cache
+ * mounts they are kept for as long as the directory mtime stays the same.
+ */
+static bool
+fuse_internal_dircache_usable(vnode_t                 vp,
+                              vfs_context_t           context,
+                              struct fuse_filehandle *fufh)
+{
+    struct fuse_vnode_data *fvdat = VTOFUD(vp);
+    struct timespec uptsp;
+
+    if (fvdat->dirpages_seen != fvdat->dirpages_gen) {
+        /* The daemon has invalidated the directory since the last readdir. */
+        fuse_dircache_purge(vp);
+        fvdat->dirpages_seen = fvdat->dirpages_gen;
+    }
+
+    if (fuse_dircache_maxsize == 0) {
+        fuse_dircache_purge(vp);
+        return false;
+    }
+
+    if (fufh->fuse_open_flags & FOPEN_KEEP_CACHE) {
+        return true;
+    }
+
+    if (!fuse_isautocache_mp(vnode_mount(vp))) {
+        fuse_dircache_purge(vp);
+        return false;
+    }
+
+    nanouptime(&uptsp);
+    if (fuse_timespec_cmp(&uptsp, &fvdat->attr_valid, >)) {
+        struct fuse_dispatcher fdi;
+        struct fuse_attr_out *fao;
+
+        fuse_dispatcher_init(&fdi, sizeof(struct fuse_getattr_in));
+        fuse_dispatcher_make_vp(&fdi, FUSE_GETATTR, vp, context);
+        bzero(fdi.indata, sizeof(struct fuse_getattr_in));
+
+        if (fuse_dispatcher_wait_answer(&fdi)) {
+            fuse_dircache_purge(vp);
+            return false;
+        }
+
+        fao = fdi.answer;
+        if ((fao->attr.mode & S_IFMT) == 0) {
+            fuse_ticket_drop(fdi.ticket);
+            fuse_dircache_purge(vp);
+            return false;
+        }
+
+        cache_attrs(vp, fao);
+        fuse_ticket_drop(fdi.ticket);
+    }
+
+    if (fuse_timespec_cmp(&VTOVA(vp)->va_modify_time, &fvdat->dirpages_mtime, !=)) {
+        fuse_dircache_purge(vp);
+        fvdat->dirpages_mtime = VTOVA(vp)->va_modify_time;
+    }
+
+    return true;
+}
+
+/*
+ * Takes in one FUSE_READDIRPLUS entry: the daemon has counted a lookup for
+ * it, so it gets a vnode with fresh attributes and a name cache entry, just
+ * as if it had gone through fuse_vnop_lookup.
+ */
+static void
+fuse_internal_readdirplus_entry(vnode_t                dvp,
+                                struct fuse_direntplus *fudp,
+                                vfs_context_t          context)
+{
+    struct fuse_entry_out *feo = &fudp->entry_out;
+    struct fuse_dispatcher fdi;
+    struct componentname cn;
+    mount_t mp = vnode_mount(dvp);
+    vnode_t vp;
+
+    if (fuse_internal_checkentry(feo, IFTOVT(feo->attr.mode)) ||
+        FSNodeGetOrCreateFileVNodeByID(&vp, false, feo, mp, dvp,
+                                       context, NULL)) {
+        fuse_internal_forget_send(mp, context, feo->nodeid, 1, &fdi);
+        return;
+    }
+
+    VTOFUD(vp)->nlookup++;
+
+    /* ATTR_FUDGE_CASE */
+    if (vnode_isreg(vp) && fuse_isdirectio(vp)) {
+        VTOFUD(vp)->filesize = feo->attr.size;
+    }
+
+    cache_attrs(vp, feo);
+
+    if (!fuse_isnovncache_mp(mp)) {
+        bzero(&cn, sizeof(cn));
+        cn.cn_nameiop = LOOKUP;
+        cn.cn_flags = MAKEENTRY;
+        cn.cn_nameptr = fudp->dirent.name;
+        cn.cn_namelen = (int)fudp->dirent.namelen;
+        fuse_vncache_enter(dvp, vp, &cn);
+    }
+
+    vnode_put(vp);
+}
+
+/*
+ * Primes the vnodes of every entry in a FUSE_READDIRPLUS answer and squeezes
+ * the answer, in place, into the plain fuse_dirent stream the rest of
+ * readdir works with. Returns the size of that stream.
+ */
+static size_t
+fuse_internal_readdirplus_prime(vnode_t       dvp,
+                                void         *buf,
+                                size_t        bufsize,
+                                vfs_context_t context)
+{
+    char *in  = buf;
+    char *out = buf;
+
+    while (bufsize >= FUSE_NAME_OFFSET_DIRENTPLUS) {
+        struct fuse_direntplus *fudp = (struct fuse_direntplus *)in;
+        struct fuse_dirent *fudge = &fudp->dirent;
+        size_t freclen = FUSE_DIRENTPLUS_SIZE(fudp);
+        size_t plainlen = FUSE_DIRENT_SIZE(fudge);
+
+        if (bufsize < freclen) {
+            break;
+        }
+
+        /* No lookup is counted for "." and "..". */
+        if (fudp->entry_out.nodeid != FUSE_NULL_ID &&
+            fudge->namelen > 0 && fudge->namelen <= FUSE_MAXNAMLEN &&
+            !(fudge->name[0] == '.' &&
+              (fudge->namelen == 1 ||
+               (fudge->namelen == 2 && fudge->name[1] == '.')))) {
+            fuse_internal_readdirplus_entry(dvp, fudp, context);
+        }
+
+        memmove(out, fudge, plainlen);
+        out += plainlen;
+        in += freclen;
+        bufsize -= freclen;
+    }
+
+    return (size_t)(out - (char *)buf);
+}
+
 __private_extern__
 int
 fuse_internal_readdir(vnode_t                 vp,
                       uio_t                   uio,
+                      int                     flags,
                       vfs_context_t           context,
                       struct fuse_filehandle *fufh,
                       struct fuse_iov        *cookediov,
                       int                    *numdirent)
 {
     int err = 0;
+    bool cached;
+    bool plus;
     struct fuse_dispatcher fdi;
     struct fuse_read_in   *fri;
-    struct fuse_data      *data;
+    struct fuse_data      *data = fuse_get_mpdata(vnode_mount(vp));
 
     if (uio_resid(uio) == 0) {
         return 0;
@@ -586,25 +1241,68 @@ fuse_internal_readdir(vnode_t                 vp,
 
     fuse_dispatcher_init(&fdi, 0);
 
+    plus = (data->dataflags & FSESS_READDIRPLUS) &&
+           fuse_implemented(data, FSESS_NOIMPLBIT(READDIRPLUS));
+
+    cached = fuse_internal_dircache_usable(vp, context, fufh);
+
     /* Note that we DO NOT have a UIO_SYSSPACE here (so no need for p2p I/O). */
 
     while (uio_resid(uio) > 0) {
 
+        if (cached) {
+            void *buf;
+            size_t bufsize;
+
+            if (fuse_dircache_lookup(vp, uio_offset(uio), &buf, &bufsize)) {
+                OSIncrementAtomic((SInt32 *)&fuse_dircache_hits);
+                if ((err = fuse_internal_readdir_processdata(vp,
+                                                             uio,
+                                                             flags,
+                                                             bufsize,
+                                                             buf,
+                                                             bufsize,
+                                                             cookediov,
+                                                             numdirent))) {
+                    break;
+                }
+                continue;
+            }
+            OSIncrementAtomic((SInt32 *)&fuse_dircache_misses);
+        }
+
         fdi.iosize = sizeof(*fri);
-        fuse_dispatcher_make_vp(&fdi, FUSE_READDIR, vp, context);
+        fuse_dispatcher_make_vp(&fdi, plus ? FUSE_READDIRPLUS : FUSE_READDIR,
+                                vp, context);
 
         fri = fdi.indata;
         fri->fh = fufh->fh_id;
         fri->offset = uio_offset(uio);
-        data = fuse_get_mpdata(vnode_mount(vp));
         fri->size = (typeof(fri->size))min((size_t)uio_resid(uio), data->iosize);
 
         if ((err = fuse_dispatcher_wait_answer(&fdi))) {
+            if (err == ENOSYS && plus) {
+                /* The ticket is gone; retry this offset with FUSE_READDIR. */
+                fuse_clear_implemented(data, FSESS_NOIMPLBIT(READDIRPLUS));
+                plus = false;
+                fuse_dispatcher_init(&fdi, 0);
+                continue;
+            }
             goto out;
         }
 
+        if (plus) {
+            fdi.iosize = fuse_internal_readdirplus_prime(vp, fdi.answer,
+                                                         fdi.iosize, context);
+        }
+
+        if (cached) {
+            fuse_dircache_store(vp, fri->offset, fdi.answer, fdi.iosize);
+        }
+
         if ((err = fuse_internal_readdir_processdata(vp,
                                                      uio,
+                                                     flags,
                                                      fri->size,
                                                      fdi.answer,
                                                      fdi.iosize,
@@ -616,7 +1314,11 @@ fuse_internal_readdir(vnode_t                 vp,
 
 /* done: */
 
-    fuse_ticket_drop(fdi.ticket);
+    /* Reading from the daemon may have touched the directory atime. */
+    if (fdi.ticket) {
+        fuse_ticket_drop(fdi.ticket);
+        fuse_invalidate_attr(vp);
+    }
 
 out:
     return ((err == -1) ? 0 : err);
@@ -626,6 +1328,7 @@ __private_extern__
 int
 fuse_internal_readdir_processdata(vnode_t          vp,
                                   uio_t            uio,
+                                  int              flags,
                          __unused size_t           reqsize,
                                   void            *buf,
                                   size_t           bufsize,
@@ -637,14 +1340,30 @@ fuse_internal_readdir_processdata(vnode_t          vp,
     int n   = 0;
     size_t bytesavail;
     size_t freclen;
+    size_t staged = 0;
+    size_t stagesize;
+    off_t  lastoff = 0;
+    bool   extended = (flags & VNODE_READDIR_EXTENDED) != 0;
+    bool   whiteout;
 
     struct dirent      *de;
+    struct direntry    *xde;
     struct fuse_dirent *fudge;
 
     if (bufsize < FUSE_NAME_OFFSET) {
         return -1;
     }
 
+    /*
+     * The whole reply is converted into cookediov and copied out with a
+     * single uiomove. A struct dirent or direntry is at most five bytes
+     * longer than the fuse_dirent it comes from, and a fuse_dirent takes at
+     * least FUSE_NAME_OFFSET bytes, so this is enough room for the reply.
+     */
+    stagesize = min((size_t)uio_resid(uio), bufsize + bufsize / 4);
+    fiov_adjust(cookediov, stagesize);
+    bzero(cookediov->base, stagesize);
+
     for (;;) {
 
         if (bufsize < FUSE_NAME_OFFSET) {
@@ -681,49 +1400,66 @@ fuse_internal_readdir_processdata(vnode_t          vp,
             break;
         }
 
-        bytesavail = (sizeof(struct dirent) - (FUSE_MAXNAMLEN + 1)) +
-            ((fudge->namelen + 1 + 3) & ~3);
+        if (extended) {
+            bytesavail = FUSE_EXT_DIRENT_LEN(fudge->namelen);
+        } else {
+            bytesavail = (sizeof(struct dirent) - (FUSE_MAXNAMLEN + 1)) +
+                ((fudge->namelen + 1 + 3) & ~3);
+        }
 
-        if (bytesavail > (size_t)uio_resid(uio)) {
+        if (staged + bytesavail > stagesize) {
             err = -1;
             break;
         }
 
-        fiov_refresh(cookediov);
-        fiov_adjust(cookediov, bytesavail);
-
-        de = (struct dirent *)cookediov->base;
+        /* Filter out any ._* files if the mount is configured as such. */
+        whiteout = fuse_skip_apple_double_mp(vnode_mount(vp),
+                                             fudge->name, fudge->namelen);
+
+        /* The staging buffer is zeroed, so the name is already terminated. */
+        if (extended) {
+            /* The daemon's cookie is the seek offset of the next entry. */
+            xde = (struct direntry *)((char *)cookediov->base + staged);
+            xde->d_ino     = whiteout ? 0 : fudge->ino;
+            xde->d_seekoff = fudge->off;
+            xde->d_reclen  = bytesavail;
+            xde->d_namlen  = fudge->namelen;
+            xde->d_type    = whiteout ? DT_WHT : fudge->type;
+            memcpy(xde->d_name, (char *)buf + FUSE_NAME_OFFSET, fudge->namelen);
+        } else {
+            de = (struct dirent *)((char *)cookediov->base + staged);
 #ifdef _DARWIN_FEATURE_64_BIT_INODE
-        de->d_ino = fudge->ino;
+            de->d_ino = fudge->ino;
 #else
-        de->d_ino = (ino_t)fudge->ino; /* XXX: truncation */
+            de->d_ino = (ino_t)fudge->ino; /* XXX: truncation */
 #endif /* _DARWIN_FEATURE_64_BIT_INODE */
-        de->d_reclen = bytesavail;
-        de->d_type   = fudge->type;
-        de->d_namlen = fudge->namelen;
-
-        /* Filter out any ._* files if the mount is configured as such. */
-        if (fuse_skip_apple_double_mp(vnode_mount(vp),
-                                      fudge->name, fudge->namelen)) {
-            de->d_ino = 0;
-            de->d_type = DT_WHT;
-        }
+            de->d_reclen = bytesavail;
+            de->d_type   = fudge->type;
+            de->d_namlen = fudge->namelen;
 
-        memcpy((char *)cookediov->base +
-               sizeof(struct dirent) - FUSE_MAXNAMLEN - 1,
-               (char *)buf + FUSE_NAME_OFFSET, fudge->namelen);
-        ((char *)cookediov->base)[bytesavail] = '\0';
+            if (whiteout) {
+                de->d_ino = 0;
+                de->d_type = DT_WHT;
+            }
 
-        err = uiomove(cookediov->base, (int)cookediov->len, uio);
-        if (err) {
-            break;
+            memcpy(de->d_name, (char *)buf + FUSE_NAME_OFFSET, fudge->namelen);
         }
 
+        staged += bytesavail;
+        lastoff = fudge->off;
         n++;
 
         buf = (char *)buf + freclen;
         bufsize -= freclen;
-        uio_setoffset(uio, fudge->off);
+    }
+
+    if (staged > 0) {
+        int moveerr = uiomove(cookediov->base, (int)staged, uio);
+        if (moveerr) {
+            err = moveerr;
+        } else {
+            uio_setoffset(uio, lastoff);
+        }
     }
 
     if (!err && numdirent) {
@@ -787,6 +1523,7 @@ fuse_internal_remove(vnode_t               dvp,
 
     fuse_invalidate_attr(dvp);
     fuse_invalidate_attr(vp);
+    fuse_dircache_purge(dvp);
 
     /*
      * XXX: M_FUSE4X_INVALIDATE_CACHED_VATTRS_UPON_UNLINK
@@ -858,6 +1595,9 @@ fuse_internal_rename(vnode_t               fdvp,
         }
     }
 
+    fuse_dircache_purge(fdvp);
+    fuse_dircache_purge(tdvp);
+
     return err;
 }
 
@@ -1108,6 +1848,9 @@ fuse_internal_strategy(vnode_t vp, buf_t bp)
             fwi->fh = fufh->fh_id;
             fwi->offset = offset;
             fwi->size = (typeof(fwi->size))chunksize;
+            if (fuse_iswritebackcache(vp)) {
+                fwi->write_flags = FUSE_WRITE_CACHE;
+            }
 
             fdi.ticket->ms_type = FT_M_BUF;
             fdi.ticket->ms_bufdata = bufdat;
@@ -1319,6 +2062,7 @@ fuse_internal_newentry(vnode_t               dvp,
                                        bufsize, &fdi, context);
     err = fuse_internal_newentry_core(dvp, vpp, cnp, vtype, &fdi, context);
     fuse_invalidate_attr(dvp);
+    fuse_dircache_purge(dvp);
 
     return err;
 }
@@ -1436,6 +2180,32 @@ fuse_internal_init_callback(struct fuse_ticket *ticket, __unused uio_t uio)
         data->dataflags |= FSESS_ATOMIC_O_TRUNC;
     }
 
+    if (fiio->flags & FUSE_DO_READDIRPLUS) {
+        data->dataflags |= FSESS_READDIRPLUS;
+    }
+
+    if (!(data->dataflags & FSESS_LOCAL_LOCKS)) {
+        if (fiio->flags & FUSE_POSIX_LOCKS) {
+            data->dataflags |= FSESS_POSIX_LOCKS;
+            if (fiio->flags & FUSE_FLOCK_LOCKS) {
+                data->dataflags |= FSESS_FLOCK_LOCKS;
+            }
+        } else {
+            /* Keep the locks here, they still work for a single host. */
+            data->dataflags |= FSESS_LOCAL_LOCKS;
+            vfs_setlocklocal(data->mp);
+        }
+    }
+
+    if ((fiio->flags & FUSE_WRITEBACK_CACHE) &&
+        (data->dataflags & FSESS_WRITEBACK_OPT)) {
+        /* Cached writes need an asynchronous mount. */
+        data->dataflags |= FSESS_WRITEBACK_CACHE;
+        fuse_setnosyncwrites_mp(data->mp);
+        log("fuse4x: writeback cache enabled, writes to %s are asynchronous\n",
+            vfs_statfs(data->mp)->f_mntfromname);
+    }
+
 out:
     fuse_ticket_drop(ticket);
 
@@ -1464,14 +2234,461 @@ fuse_send_init(struct fuse_data *data, vfs_context_t context)
     fiii->major = FUSE_KERNEL_VERSION;
     fiii->minor = FUSE_KERNEL_MINOR_VERSION;
     fiii->max_readahead = data->iosize * 16;
-    fiii->flags = 0;
+    fiii->flags = FUSE_DO_READDIRPLUS;
+    if (!(data->dataflags & FSESS_LOCAL_LOCKS)) {
+        fiii->flags |= FUSE_POSIX_LOCKS | FUSE_FLOCK_LOCKS;
+    }
+    if (data->dataflags & FSESS_WRITEBACK_OPT) {
+        fiii->flags |= FUSE_WRITEBACK_CACHE;
+    }
 
-    fuse_insert_callback(fdi.ticket, fuse_internal_init_callback);
-    fuse_insert_message(fdi.ticket);
+    fuse_insert_request(fdi.ticket, fuse_internal_init_callback);
+
+    return 0;
+}
+
+/* notifications */
+
+/* Returns the vnode of nodeid with an iocount, or NULLVP if there is none. */
+static vnode_t
+fuse_internal_notify_vnode(struct fuse_data *data, uint64_t nodeid)
+{
+    vnode_t vp = NULLVP;
+    uint32_t vid = 0;
+    struct fuse_vnode_data *fvdat;
+    struct fuse_vnode_data tt = {
+        .nodeid = nodeid
+    };
+
+    fuse_lck_mtx_lock(data->node_mtx);
+    fvdat = RB_FIND(fuse_data_nodes, &data->nodes_head, &tt);
+    if (fvdat) {
+        vp = fvdat->vp;
+        vid = fvdat->vid;
+    }
+    fuse_lck_mtx_unlock(data->node_mtx);
+
+    if (vp && vnode_getwithvid(vp, vid)) {
+        vp = NULLVP;
+    }
+
+    return vp;
+}
+
+/*
+ * Drops everything cached for vp except its data pages. Vnops hold the
+ * nodelock while they wait for the daemon, so the readdir cache is only
+ * marked stale here and emptied by the next readdir.
+ */
+static void
+fuse_internal_notify_flush(struct fuse_data *data, vnode_t vp)
+{
+    struct fuse_vnode_data *fvdat = VTOFUD(vp);
+
+#ifdef FUSE4X_ENABLE_BIGLOCK
+    fuse_biglock_lock(data->biglock);
+#endif
+    fuse_invalidate_attr(vp);
+#ifdef FUSE4X_ENABLE_BIGLOCK
+    fuse_biglock_unlock(data->biglock);
+#endif
+    fuse_dircache_invalidate(vp);
+
+    fuse_lck_mtx_lock(data->node_mtx);
+    bzero(&fvdat->link_target_expires, sizeof(struct timespec));
+    fuse_lck_mtx_unlock(data->node_mtx);
+
+    fuse_xattrcache_purge(vp);
+}
+
+static int
+fuse_internal_notify_inval_inode(struct fuse_data *data, uio_t uio)
+{
+    int err;
+    vnode_t vp;
+    struct fuse_notify_inval_inode_out fniio;
+
+    if (uio_resid(uio) != sizeof(fniio)) {
+        return EINVAL;
+    }
+
+    if ((err = uiomove((caddr_t)&fniio, (int)sizeof(fniio), uio))) {
+        return err;
+    }
+
+    vp = fuse_internal_notify_vnode(data, fniio.ino);
+    if (!vp) {
+        return ENOENT;
+    }
+
+    fuse_internal_notify_flush(data, vp);
+
+    /* A negative offset asks for the attributes only. */
+    if (fniio.off >= 0 && vnode_isreg(vp)) {
+        off_t end;
+
+        /* A length reaching past the largest offset means "to the end". */
+        if (fniio.len <= 0 || fniio.len > INT64_MAX - fniio.off) {
+            end = ubc_getsize(vp);
+        } else {
+            end = fniio.off + fniio.len;
+        }
+
+        if (fniio.off < end) {
+            (void)ubc_msync(vp, fniio.off, end, NULL,
+                            UBC_PUSHDIRTY | UBC_INVALIDATE);
+        }
+    }
+
+    vnode_put(vp);
+
+    return 0;
+}
+
+static int
+fuse_internal_notify_inval_entry(struct fuse_data *data, uio_t uio)
+{
+    int err;
+    vnode_t dvp;
+    vnode_t vp = NULLVP;
+    struct componentname cn;
+    struct fuse_notify_inval_entry_out fnieo;
+    char name[FUSE_MAXNAMLEN + 1];
+
+    if (uio_resid(uio) < (user_ssize_t)sizeof(fnieo)) {
+        return EINVAL;
+    }
+
+    if ((err = uiomove((caddr_t)&fnieo, (int)sizeof(fnieo), uio))) {
+        return err;
+    }
+
+    if (fnieo.namelen == 0 || fnieo.namelen > FUSE_MAXNAMLEN ||
+        uio_resid(uio) != (user_ssize_t)fnieo.namelen + 1) {
+        return EINVAL;
+    }
+
+    if ((err = uiomove(name, (int)fnieo.namelen + 1, uio))) {
+        return err;
+    }
+
+    if (name[fnieo.namelen] != '\0') {
+        return EINVAL;
+    }
+
+    dvp = fuse_internal_notify_vnode(data, fnieo.parent);
+    if (!dvp) {
+        return ENOENT;
+    }
+
+    /*
+     * cache_lookup() without MAKEENTRY removes whatever entry it finds,
+     * positive or negative, which is exactly what we want here.
+     */
+    bzero(&cn, sizeof(cn));
+    cn.cn_nameiop = LOOKUP;
+    cn.cn_flags = ISLASTCN;
+    cn.cn_nameptr = name;
+    cn.cn_namelen = (int)fnieo.namelen;
+
+    if (fuse_vncache_lookup(dvp, &vp, &cn) == -1) {
+        vnode_put(vp);
+    }
+
+    fuse_internal_notify_flush(data, dvp);
+
+    vnode_put(dvp);
 
     return 0;
 }
 
+/*
+ * Fills in pages of vp that are not resident yet with data pushed by the
+ * daemon. Pages already in the cache are left alone, so a daemon that wants
+ * to replace them has to invalidate the range first. Only whole pages can be
+ * filled; the last page of the file counts as whole when the data reaches
+ * EOF, since the rest of it is zero.
+ */
+static int
+fuse_internal_notify_store(struct fuse_data *data, uio_t uio)
+{
+    int err = 0;
+    vnode_t vp;
+    upl_t upl;
+    upl_page_info_t *pl;
+    vm_offset_t map;
+    off_t start, end, filesize, pgstart, pgend, pgoff, upllen;
+    int i, npages;
+    struct fuse_vnode_data *fvdat;
+    struct fuse_notify_store_out fnso;
+
+    if (uio_resid(uio) < (user_ssize_t)sizeof(fnso)) {
+        return EINVAL;
+    }
+
+    if ((err = uiomove((caddr_t)&fnso, (int)sizeof(fnso), uio))) {
+        return err;
+    }
+
+    if (uio_resid(uio) != (user_ssize_t)fnso.size ||
+        fnso.offset > (uint64_t)INT64_MAX - fnso.size) {
+        return EINVAL;
+    }
+
+    vp = fuse_internal_notify_vnode(data, fnso.nodeid);
+    if (!vp) {
+        return ENOENT;
+    }
+
+    if (!vnode_isreg(vp)) {
+        err = EINVAL;
+        goto out;
+    }
+
+    fvdat = VTOFUD(vp);
+    start = (off_t)fnso.offset;
+    end = start + fnso.size;
+
+    /* Just like a write, a store past EOF extends the file. */
+#ifdef FUSE4X_ENABLE_BIGLOCK
+    fuse_biglock_lock(data->biglock);
+#endif
+    if (end > fvdat->filesize) {
+        fvdat->filesize = end;
+        ubc_setsize(vp, end);
+    }
+    filesize = fvdat->filesize;
+#ifdef FUSE4X_ENABLE_BIGLOCK
+    fuse_biglock_unlock(data->biglock);
+#endif
+
+    pgstart = round_page_64(start);
+    pgend = (end == filesize) ? round_page_64(end) : trunc_page_64(end);
+    if (pgstart >= pgend) {
+        goto out;
+    }
+
+    uio_update(uio, (user_size_t)(pgstart - start));
+
+    /*
+     * A UPL is limited in size, so the store goes in pieces of at most
+     * max_write bytes, the most the daemon could have written in one go.
+     */
+    upllen = (off_t)trunc_page_64(data->max_write);
+    if (upllen < PAGE_SIZE) {
+        upllen = PAGE_SIZE;
+    }
+
+    for (pgoff = pgstart; pgoff < pgend && !err; ) {
+        off_t uplstart = pgoff;
+        off_t uplsize = (pgend - uplstart < upllen) ? pgend - uplstart : upllen;
+
+        npages = (int)(uplsize / PAGE_SIZE);
+
+        if (ubc_create_upl(vp, uplstart, npages * PAGE_SIZE, &upl, &pl,
+                           UPL_RET_ONLY_ABSENT | UPL_SET_LITE) != KERN_SUCCESS) {
+            err = EIO;
+            break;
+        }
+
+        if (ubc_upl_map(upl, &map) != KERN_SUCCESS) {
+            ubc_upl_abort(upl, UPL_ABORT_FREE_ON_EMPTY);
+            err = EIO;
+            break;
+        }
+
+        for (i = 0; i < npages; i++, pgoff += PAGE_SIZE) {
+            int chunk = (end - pgoff < PAGE_SIZE) ? (int)(end - pgoff) : PAGE_SIZE;
+            caddr_t page = (caddr_t)map + i * PAGE_SIZE;
+
+            if (!upl_page_present(pl, i)) {
+                uio_update(uio, (user_size_t)chunk);
+                continue;
+            }
+
+            if ((err = uiomove(page, chunk, uio))) {
+                break;
+            }
+
+            if (chunk < PAGE_SIZE) {
+                bzero(page + chunk, PAGE_SIZE - chunk);
+            }
+        }
+
+        (void)ubc_upl_unmap(upl);
+
+        if (err) {
+            ubc_upl_abort_range(upl, 0, npages * PAGE_SIZE,
+                                UPL_ABORT_FREE_ON_EMPTY | UPL_ABORT_DUMP_PAGES);
+        } else {
+            ubc_upl_commit_range(upl, 0, npages * PAGE_SIZE,
+                                 UPL_COMMIT_CLEAR_DIRTY | UPL_COMMIT_FREE_ON_EMPTY);
+        }
+    }
+
+out:
+    vnode_put(vp);
+
+    return err;
+}
+
+/*
+ * Sends back the resident pages of vp that the daemon asked for as a
+ * FUSE_NOTIFY_REPLY message. The reply stops at the first page that is not
+ * in the cache. The daemon does not answer it, so no one waits on the ticket.
+ */
+static int
+fuse_internal_notify_retrieve(struct fuse_data *data, uio_t uio)
+{
+    int err = 0;
+    vnode_t vp;
+    upl_t upl;
+    upl_page_info_t *pl;
+    vm_offset_t map;
+    off_t start, end, filesize, pgstart, pgend, pgoff;
+    size_t len, copied = 0;
+    char *buf = NULL;
+    int i, npages;
+    struct fuse_dispatcher fdi;
+    struct fuse_notify_retrieve_in *fnri;
+    struct fuse_notify_retrieve_out fnro;
+
+    if (uio_resid(uio) != sizeof(fnro)) {
+        return EINVAL;
+    }
+
+    if ((err = uiomove((caddr_t)&fnro, (int)sizeof(fnro), uio))) {
+        return err;
+    }
+
+    if (fnro.offset > (uint64_t)INT64_MAX) {
+        return EINVAL;
+    }
+
+    vp = fuse_internal_notify_vnode(data, fnro.nodeid);
+    if (!vp) {
+        return ENOENT;
+    }
+
+    if (!vnode_isreg(vp)) {
+        err = EINVAL;
+        goto out;
+    }
+
+#ifdef FUSE4X_ENABLE_BIGLOCK
+    fuse_biglock_lock(data->biglock);
+#endif
+    filesize = VTOFUD(vp)->filesize;
+#ifdef FUSE4X_ENABLE_BIGLOCK
+    fuse_biglock_unlock(data->biglock);
+#endif
+
+    start = (off_t)fnro.offset;
+    len = min((size_t)fnro.size, (size_t)data->max_write);
+    if (start >= filesize) {
+        len = 0;
+    } else if ((off_t)len > filesize - start) {
+        len = (size_t)(filesize - start);
+    }
+    end = start + len;
+
+    if (len > 0) {
+        pgstart = trunc_page_64(start);
+        pgend = round_page_64(end);
+        npages = (int)((pgend - pgstart) / PAGE_SIZE);
+
+        buf = FUSE_OSMalloc(len, fuse_malloc_tag);
+        if (!buf) {
+            err = ENOMEM;
+            goto out;
+        }
+
+        if (ubc_create_upl(vp, pgstart, (int)(pgend - pgstart), &upl, &pl,
+                           UPL_FLAGS_NONE) != KERN_SUCCESS) {
+            err = EIO;
+            goto out;
+        }
+
+        if (ubc_upl_map(upl, &map) != KERN_SUCCESS) {
+            ubc_upl_abort(upl, UPL_ABORT_FREE_ON_EMPTY);
+            err = EIO;
+            goto out;
+        }
+
+        for (i = 0, pgoff = pgstart; i < npages; i++, pgoff += PAGE_SIZE) {
+            /* min() and max() would truncate these to 32 bits. */
+            off_t from = (pgoff > start) ? pgoff : start;
+            off_t to = (pgoff + PAGE_SIZE < end) ? pgoff + PAGE_SIZE : end;
+
+            if (!upl_valid_page(pl, i)) {
+                break;
+            }
+
+            memcpy(buf + copied, (caddr_t)map + (from - pgstart), (size_t)(to - from));
+            copied += (size_t)(to - from);
+        }
+
+        (void)ubc_upl_unmap(upl);
+        ubc_upl_abort_range(upl, 0, npages * PAGE_SIZE, UPL_ABORT_FREE_ON_EMPTY);
+    }
+
+    fuse_dispatcher_init(&fdi, sizeof(*fnri) + copied);
+    fuse_dispatcher_make(&fdi, FUSE_NOTIFY_REPLY, data->mp, fnro.nodeid, NULL);
+
+    /* The daemon matches the reply by the unique it chose itself. */
+    fdi.finh->unique = fnro.notify_unique;
+
+    fnri = fdi.indata;
+    bzero(fnri, sizeof(*fnri));
+    fnri->offset = fnro.offset;
+    fnri->size = (uint32_t)copied;
+    if (copied) {
+        memcpy((char *)fdi.indata + sizeof(*fnri), buf, copied);
+    }
+
+    fdi.ticket->invalid = true;
+    fuse_insert_message(fdi.ticket);
+
+out:
+    if (buf) {
+        FUSE_OSFree(buf, len, fuse_malloc_tag);
+    }
+
+    vnode_put(vp);
+
+    return err;
+}
+
+/*
+ * Handles a message the daemon sent on its own (unique == 0) rather than as
+ * the answer to a request. The error field of the header carries the code.
+ */
+__private_extern__
+int
+fuse_internal_notify(struct fuse_data *data, int code, uio_t uio)
+{
+    if (!data || !data->mounted || data->dead) {
+        return ENODEV;
+    }
+
+    switch (code) {
+    case FUSE_NOTIFY_INVAL_INODE:
+        return fuse_internal_notify_inval_inode(data, uio);
+
+    case FUSE_NOTIFY_INVAL_ENTRY:
+        return fuse_internal_notify_inval_entry(data, uio);
+
+    case FUSE_NOTIFY_STORE:
+        return fuse_internal_notify_store(data, uio);
+
+    case FUSE_NOTIFY_RETRIEVE:
+        return fuse_internal_notify_retrieve(data, uio);
+
+    default:
+        return ENOSYS;
+    }
+}
+
 /* other */
 
 static int
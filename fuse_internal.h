@@ -48,6 +48,16 @@ struct fuse_ticket;
            }                                   \
     } while (0)
 
+#define fuse_timespec_sub(vvp, uvp)            \
+    do {                                       \
+           (vvp)->tv_sec -= (uvp)->tv_sec;     \
+           (vvp)->tv_nsec -= (uvp)->tv_nsec;   \
+           if ((vvp)->tv_nsec < 0) {           \
+               (vvp)->tv_sec--;                \
+               (vvp)->tv_nsec += 1000000000;   \
+           }                                   \
+    } while (0)
+
 #define fuse_timespec_cmp(tvp, uvp, cmp)       \
         (((tvp)->tv_sec == (uvp)->tv_sec) ?    \
          ((tvp)->tv_nsec cmp (uvp)->tv_nsec) : \
@@ -182,6 +192,23 @@ fuse_isnosynconclose(vnode_t vp)
     return (fuse_get_mpdata(vnode_mount(vp))->dataflags & FSESS_NO_SYNCONCLOSE);
 }
 
+/*
+ * In writeback cache mode writes only dirty the UBC and the kernel owns the
+ * size and mtime of the file until the pages reach the daemon.
+ */
+static __inline__
+bool
+fuse_iswritebackcache(vnode_t vp)
+{
+    mount_t mp = vnode_mount(vp);
+
+    if (fuse_isdirectio(vp) || vfs_issynchronous(mp)) {
+        return false;
+    }
+
+    return (fuse_get_mpdata(mp)->dataflags & FSESS_WRITEBACK_CACHE);
+}
+
 static __inline__
 int
 fuse_isnosyncwrites_mp(mount_t mp)
@@ -423,6 +450,9 @@ fuse_internal_attr_vat2fsai(mount_t                 mp,
                             struct fuse_setattr_in *fsai,
                             uint64_t               *newsize);
 
+int
+fuse_internal_attr_flush_mtime(vnode_t vp, vfs_context_t context);
+
 static __inline__
 void
 fuse_internal_attr_fat2vat(vnode_t            vp,
@@ -470,8 +500,13 @@ fuse_internal_attr_fat2vat(vnode_t            vp,
     t.tv_nsec = fat->ctimensec;
     VATTR_RETURN(vap, va_change_time, t);
 
-    t.tv_sec = (typeof(t.tv_sec))fat->mtime; /* XXX: truncation */
-    t.tv_nsec = fat->mtimensec;
+    if ((fvdat->flag & FN_MTIME_DIRTY) && fuse_iswritebackcache(vp)) {
+        /* Our cached writes are newer than whatever the daemon has. */
+        t = fvdat->modify_time;
+    } else {
+        t.tv_sec = (typeof(t.tv_sec))fat->mtime; /* XXX: truncation */
+        t.tv_nsec = fat->mtimensec;
+    }
     VATTR_RETURN(vap, va_modify_time, t);
 
     t.tv_sec = (typeof(t.tv_sec))fat->crtime; /* XXX: truncation */
@@ -599,6 +634,56 @@ fuse_internal_attr_loadvap(vnode_t vp, struct vnode_attr *out_vap,
     fuse_internal_attr_fat2vat(vp, &(fuse_out)->attr, VTOVA(vp));    \
 } while (0)
 
+/* attribute prefetch */
+
+void
+fuse_internal_attr_prefetch(vnode_t vp, vfs_context_t context);
+
+bool
+fuse_internal_attr_prefetched(vnode_t vp, struct fuse_attr_out *fao);
+
+/* single-flight */
+
+/*
+ * An upcall that concurrent callers asking the very same question share.
+ * The first caller (the leader) sends it and fills in the answer, the
+ * others (followers) sleep until the leader lands the flight.
+ */
+struct fuse_flight {
+    LIST_ENTRY(fuse_flight) link;
+    uint32_t                opcode;
+    uint64_t                nodeid;
+    uid_t                   uid;
+    size_t                  namelen;
+    char                    name[FUSE_MAXNAMLEN + 1];
+
+    uint32_t                refs;  // leader and followers, protected by node_mtx
+    bool                    done;  // protected by node_mtx
+    int                     err;
+    union {
+        struct fuse_attr_out attr; // FUSE_GETATTR
+        struct {
+            vnode_t          vp;
+            uint32_t         vid;
+        } node;                    // FUSE_LOOKUP
+    } answer;
+};
+
+struct fuse_flight *
+fuse_internal_flight_join(struct fuse_data *data, uint32_t opcode,
+                          uint64_t nodeid, const char *name, size_t namelen,
+                          vfs_context_t context, bool *leader);
+
+int
+fuse_internal_flight_wait(struct fuse_data *data, struct fuse_flight *flight);
+
+void
+fuse_internal_flight_land(struct fuse_data *data, struct fuse_flight *flight,
+                          int err);
+
+void
+fuse_internal_flight_put(struct fuse_data *data, struct fuse_flight *flight);
+
 #ifdef FUSE4X_ENABLE_EXCHANGE
 
 /* exchange */
@@ -629,9 +714,14 @@ fuse_internal_fsync_callback(struct fuse_ticket *ticket, uio_t uio);
 
 /* readdir */
 
+/* Record length of a struct direntry, as returned for VNODE_READDIR_EXTENDED */
+#define FUSE_EXT_DIRENT_LEN(namlen) \
+    ((offsetof(struct direntry, d_name) + (namlen) + 1 + 7) & ~7)
+
 int
 fuse_internal_readdir(vnode_t                 vp,
                       uio_t                   uio,
+                      int                     flags,
                       vfs_context_t           context,
                       struct fuse_filehandle *fufh,
                       struct fuse_iov        *cookediov,
@@ -640,6 +730,7 @@ fuse_internal_readdir(vnode_t                 vp,
 int
 fuse_internal_readdir_processdata(vnode_t          vp,
                                   uio_t            uio,
+                                  int              flags,
                                   size_t           reqsize,
                                   void            *buf,
                                   size_t           bufsize,
@@ -745,6 +836,10 @@ fuse_internal_interrupt_send(struct fuse_ticket *ticket);
 int fuse_internal_init_callback(struct fuse_ticket *ticket, uio_t uio);
 int fuse_send_init(struct fuse_data *data, vfs_context_t context);
 
+/* notifications */
+
+int fuse_internal_notify(struct fuse_data *data, int code, uio_t uio);
+
 /* other */
 
 static __inline__
@@ -230,11 +230,93 @@ fuse_ticket_destroy(struct fuse_ticket *ticket)
     OSDecrementAtomic((SInt32 *)&fuse_tickets_current);
 }
 
+/*
+ * Returns how long to poll for the answer before sleeping, in absolute time
+ * units, or 0 to sleep right away. An opcode the daemon has lately answered
+ * within fuse_spin_wait_max gets twice its average answer time.
+ */
+static uint64_t
+fuse_ticket_spin_budget(struct fuse_ticket *ticket)
+{
+    uint64_t budget;
+    uint64_t limit = (uint64_t)fuse_spin_wait_max * NSEC_PER_USEC;
+    uint32_t opcode = fuse_ticket_opcode(ticket);
+    uint32_t svc;
+
+    if (!(ticket->data->dataflags & FSESS_SPIN_WAIT) ||
+        opcode >= FUSE_SVC_TIME_OPCODES) {
+        return 0;
+    }
+
+    svc = ticket->data->svc_time[opcode];
+    if (svc == 0 || svc > limit) {
+        return 0;
+    }
+
+    nanoseconds_to_absolutetime((2 * (uint64_t)svc < limit) ? 2 * (uint64_t)svc : limit,
+                                &budget);
+
+    return budget;
+}
+
+static bool
+fuse_ticket_spin(struct fuse_ticket *ticket, uint64_t budget)
+{
+    volatile struct fuse_ticket *vticket = ticket;
+    uint64_t deadline = mach_absolute_time() + budget;
+
+    do {
+        if (vticket->answered) {
+            return true;
+        }
+    } while (!ticket->data->dead && mach_absolute_time() < deadline);
+
+    return false;
+}
+
+/* Folds the latency of an answered request into the opcode's average. */
+static void
+fuse_ticket_account(struct fuse_ticket *ticket, uint64_t start)
+{
+    uint64_t ns;
+    uint32_t opcode = fuse_ticket_opcode(ticket);
+    uint32_t *svc;
+
+    if (opcode >= FUSE_SVC_TIME_OPCODES) {
+        return;
+    }
+
+    absolutetime_to_nanoseconds(mach_absolute_time() - start, &ns);
+    if (ns > UINT32_MAX) {
+        ns = UINT32_MAX;
+    }
+
+    svc = &ticket->data->svc_time[opcode];
+    *svc = *svc ? (uint32_t)((7 * (uint64_t)*svc + ns) / 8) : (uint32_t)ns;
+}
+
 static int
 fuse_ticket_wait_answer(struct fuse_ticket *ticket)
 {
     int err = 0;
     struct fuse_data *data = ticket->data;
+    uint64_t start = mach_absolute_time();
+    uint64_t budget = fuse_ticket_spin_budget(ticket);
+
+    if (budget) {
+        /* Nobody else should wait for the biglock while we spin. */
+#ifdef FUSE4X_ENABLE_BIGLOCK
+        fuse_biglock_unlock(data->biglock);
+#endif
+        if (fuse_ticket_spin(ticket, budget)) {
+            OSIncrementAtomic((SInt32 *)&fuse_spin_wait_hits);
+        } else {
+            OSIncrementAtomic((SInt32 *)&fuse_spin_wait_misses);
+        }
+#ifdef FUSE4X_ENABLE_BIGLOCK
+        fuse_biglock_lock(data->biglock);
+#endif
+    }
 
     fuse_lck_mtx_lock(ticket->aw_mtx);
 
@@ -257,7 +339,9 @@ fuse_ticket_wait_answer(struct fuse_ticket *ticket)
     fuse_biglock_unlock(data->biglock);
 #endif
 
-    err = fuse_msleep(ticket, ticket->aw_mtx, PCATCH, "fu_ans", data->daemon_timeout_p);
+    /* A lock request waits for as long as somebody else holds the lock. */
+    err = fuse_msleep(ticket, ticket->aw_mtx, PCATCH, "fu_ans",
+                      fuse_ticket_opcode(ticket) == FUSE_SETLKW ? NULL : data->daemon_timeout_p);
 
 #ifdef FUSE4X_ENABLE_BIGLOCK
     fuse_biglock_lock(data->biglock);
@@ -293,6 +377,10 @@ out:
         err = ENXIO;
     }
 
+    if (!err) {
+        fuse_ticket_account(ticket, start);
+    }
+
     return err;
 }
 
@@ -356,6 +444,7 @@ fuse_ticket_pull(struct fuse_ticket *ticket, uio_t uio)
 struct fuse_data *
 fuse_data_alloc(struct proc *p)
 {
+    int i, j;
     struct fuse_data *data;
 
     data = (struct fuse_data *)FUSE_OSMalloc(sizeof(struct fuse_data),
@@ -378,20 +467,38 @@ fuse_data_alloc(struct proc *p)
     data->inited        = false;
     data->dead          = false;
 
-    data->ms_mtx        = lck_mtx_alloc_init(fuse_lock_group, fuse_lock_attr);
     data->aw_mtx        = lck_mtx_alloc_init(fuse_lock_group, fuse_lock_attr);
     data->ticket_mtx    = lck_mtx_alloc_init(fuse_lock_group, fuse_lock_attr);
     data->node_mtx      = lck_mtx_alloc_init(fuse_lock_group, fuse_lock_attr); // TODO: it is better to use spin lock here, they are cheaper
 
-    STAILQ_INIT(&data->ms_head);
+    for (i = 0; i < FUSE4X_MAX_CHANNELS; i++) {
+        data->channels[i].fdev        = NULL;
+        data->channels[i].ms_mtx      = lck_mtx_alloc_init(fuse_lock_group, fuse_lock_attr);
+        data->channels[i].ms_pending  = NULL;
+        for (j = 0; j < FUSE4X_FAIR_FLOWS; j++) {
+            STAILQ_INIT(&data->channels[i].ms_flows[j].queue);
+        }
+        TAILQ_INIT(&data->channels[i].ms_active);
+        data->channels[i].ms_sleepers = 0;
+        data->channels[i].ms_woken    = 0;
+    }
+    for (j = 0; j < FUSE4X_FAIR_FLOWS; j++) {
+        data->flow_weights[j] = 1;
+    }
+    data->channel_slots = 1;
+
     TAILQ_INIT(&data->aw_head);
+    data->aw_pending = NULL;
     STAILQ_INIT(&data->freetickets_head);
     TAILQ_INIT(&data->alltickets_head);
     RB_INIT(&data->nodes_head);
+    LIST_INIT(&data->flights);
 
     data->freeticket_counter = 0;
     data->deadticket_counter = 0;
     data->ticketer           = 0;
+    data->admitted_tickets   = 0;
+    data->admitted_bulk      = 0;
 
 #ifdef FUSE4X_ENABLE_BIGLOCK
     data->biglock        = lck_mtx_alloc_init(fuse_lock_group, fuse_lock_attr);
@@ -403,10 +510,13 @@ fuse_data_alloc(struct proc *p)
 void
 fuse_data_destroy(struct fuse_data *data)
 {
+    int i;
     struct fuse_ticket *ticket;
 
-    lck_mtx_free(data->ms_mtx, fuse_lock_group);
-    data->ms_mtx = NULL;
+    for (i = 0; i < FUSE4X_MAX_CHANNELS; i++) {
+        lck_mtx_free(data->channels[i].ms_mtx, fuse_lock_group);
+        data->channels[i].ms_mtx = NULL;
+    }
 
     lck_mtx_free(data->aw_mtx, fuse_lock_group);
     data->aw_mtx = NULL;
@@ -432,6 +542,9 @@ fuse_data_destroy(struct fuse_data *data)
 
     kauth_cred_unref(&(data->daemoncred));
 
+    fuse_ring_free(&data->trace);
+    fuse_ring_free(&data->capture);
+
     FUSE_OSFree(data, sizeof(struct fuse_data), fuse_malloc_tag);
 }
 
@@ -439,17 +552,27 @@ fuse_data_destroy(struct fuse_data *data)
 bool
 fuse_data_kill(struct fuse_data *data)
 {
+    int i;
+    struct fuse_channel *chan = &data->channels[0];
+
     fuse_trace_printf_func();
 
-    fuse_lck_mtx_lock(data->ms_mtx);
+    fuse_lck_mtx_lock(chan->ms_mtx);
     if (data->dead) {
-        fuse_lck_mtx_unlock(data->ms_mtx);
+        fuse_lck_mtx_unlock(chan->ms_mtx);
         return false;
     }
 
     data->dead = true;
-    fuse_wakeup_one((caddr_t)data);
-    fuse_lck_mtx_unlock(data->ms_mtx);
+    fuse_wakeup_one((caddr_t)chan);
+    fuse_lck_mtx_unlock(chan->ms_mtx);
+
+    for (i = 1; i < FUSE4X_MAX_CHANNELS; i++) {
+        chan = &data->channels[i];
+        fuse_lck_mtx_lock(chan->ms_mtx);
+        fuse_wakeup((caddr_t)chan);
+        fuse_lck_mtx_unlock(chan->ms_mtx);
+    }
 
     fuse_lck_mtx_lock(data->ticket_mtx);
     fuse_wakeup(&data->ticketer);
@@ -458,6 +581,222 @@ fuse_data_kill(struct fuse_data *data)
     return true;
 }
 
+/*
+ * Adds fdev as an extra channel of the file system. Must be called with
+ * data->fdev->mtx held. Returns the index of the channel or -1 if all the
+ * channel slots are taken.
+ */
+int
+fuse_data_attach_channel(struct fuse_data *data, fuse_device_t fdev)
+{
+    int i;
+
+    for (i = 1; i < FUSE4X_MAX_CHANNELS; i++) {
+        struct fuse_channel *chan = &data->channels[i];
+
+        if (chan->fdev) {
+            continue;
+        }
+
+        fuse_lck_mtx_lock(chan->ms_mtx);
+        chan->fdev = fdev;
+        fuse_lck_mtx_unlock(chan->ms_mtx);
+
+        if (data->channel_slots <= (uint32_t)i) {
+            data->channel_slots = i + 1;
+        }
+
+        return i;
+    }
+
+    return -1;
+}
+
+static __inline__
+uint32_t
+fuse_ticket_msgsize(struct fuse_ticket *ticket)
+{
+    size_t size = ticket->ms_fiov.len;
+
+    if (ticket->ms_type == FT_M_BUF) {
+        size += ticket->ms_bufsize;
+    }
+
+    return (uint32_t)size;
+}
+
+static __inline__
+uint32_t
+fuse_flow_quantum(struct fuse_data *data, struct fuse_channel *chan,
+                  struct fuse_flow *flow)
+{
+    uint32_t quantum = fuse_fair_quantum;
+
+    if (quantum < FUSE_MIN_FAIR_QUANTUM) {
+        quantum = FUSE_MIN_FAIR_QUANTUM;
+    } else if (quantum > FUSE_MAX_FAIR_QUANTUM) {
+        quantum = FUSE_MAX_FAIR_QUANTUM;
+    }
+
+    return quantum * data->flow_weights[flow - chan->ms_flows];
+}
+
+/* Must be called with chan->ms_mtx held. */
+static __inline__
+void
+fuse_flow_activate(struct fuse_data *data, struct fuse_channel *chan,
+                   struct fuse_flow *flow)
+{
+    /* A flow joining the round gets its share right away. */
+    flow->deficit = fuse_flow_quantum(data, chan, flow);
+    TAILQ_INSERT_TAIL(&chan->ms_active, flow, active_link);
+}
+
+/*
+ * Moves the pending messages of a channel into its flows, oldest first.
+ * Must be called with chan->ms_mtx held.
+ */
+void
+fuse_channel_collect(struct fuse_channel *chan)
+{
+    struct fuse_ticket *top;
+    struct fuse_ticket *ticket;
+    struct fuse_flow *flow;
+    pid_t pid;
+    STAILQ_HEAD(, fuse_ticket) batch = STAILQ_HEAD_INITIALIZER(batch);
+
+    do {
+        top = chan->ms_pending;
+    } while (top && !OSCompareAndSwapPtr(top, NULL, (void * volatile *)&chan->ms_pending));
+
+    /* The stack is newest first; inserting at the head reverses it. */
+    while ((ticket = top)) {
+        top = ticket->ms_pending_link;
+        STAILQ_INSERT_HEAD(&batch, ticket, ms_link);
+    }
+
+    while ((ticket = STAILQ_FIRST(&batch))) {
+        STAILQ_REMOVE_HEAD(&batch, ms_link);
+
+        pid = ((struct fuse_in_header *)ticket->ms_fiov.base)->pid;
+        flow = &chan->ms_flows[fuse_fair_queueing ? (uint32_t)pid % FUSE4X_FAIR_FLOWS : 0];
+
+        if (STAILQ_EMPTY(&flow->queue)) {
+            fuse_flow_activate(ticket->data, chan, flow);
+        }
+        STAILQ_INSERT_TAIL(&flow->queue, ticket, ms_link);
+        flow->pid = pid;
+        flow->queued++;
+    }
+}
+
+/*
+ * Takes the next message in deficit round robin order: the flow at the
+ * head of ms_active sends messages while its deficit covers them, then it
+ * is topped up by its quantum and goes to the back. Must be called with
+ * chan->ms_mtx held, after fuse_channel_collect().
+ */
+struct fuse_ticket *
+fuse_channel_dequeue(struct fuse_data *data, struct fuse_channel *chan)
+{
+    struct fuse_flow *flow;
+    struct fuse_ticket *ticket;
+    uint32_t size;
+
+    while ((flow = TAILQ_FIRST(&chan->ms_active))) {
+        ticket = STAILQ_FIRST(&flow->queue);
+        size = fuse_ticket_msgsize(ticket);
+
+        if (flow->deficit < size) {
+            flow->deficit += fuse_flow_quantum(data, chan, flow);
+            TAILQ_REMOVE(&chan->ms_active, flow, active_link);
+            TAILQ_INSERT_TAIL(&chan->ms_active, flow, active_link);
+            continue;
+        }
+
+        flow->deficit -= size;
+        STAILQ_REMOVE_HEAD(&flow->queue, ms_link);
+        flow->queued--;
+        flow->served++;
+
+        if (STAILQ_EMPTY(&flow->queue)) {
+            TAILQ_REMOVE(&chan->ms_active, flow, active_link);
+            flow->deficit = 0;
+        }
+
+        return ticket;
+    }
+
+    return NULL;
+}
+
+/*
+ * Hands the messages queued on a closed clone over to the first channel so
+ * the daemon gets to see them anyway. Must be called with chan->ms_mtx held.
+ */
+static void
+fuse_channel_migrate(struct fuse_data *data, struct fuse_channel *chan)
+{
+    int i;
+    struct fuse_channel *first = &data->channels[0];
+    struct fuse_flow *from;
+    struct fuse_flow *to;
+
+    fuse_channel_collect(chan);
+
+    if (!fuse_channel_empty(chan)) {
+        fuse_lck_mtx_lock(first->ms_mtx);
+        fuse_channel_collect(first);
+        while ((from = TAILQ_FIRST(&chan->ms_active))) {
+            TAILQ_REMOVE(&chan->ms_active, from, active_link);
+            i = (int)(from - chan->ms_flows);
+            to = &first->ms_flows[i];
+            if (STAILQ_EMPTY(&to->queue)) {
+                fuse_flow_activate(data, first, to);
+            }
+            STAILQ_CONCAT(&to->queue, &from->queue);
+            to->pid = from->pid;
+            to->queued += from->queued;
+            from->queued = 0;
+            from->deficit = 0;
+        }
+        fuse_wakeup((caddr_t)first);
+        fuse_lck_mtx_unlock(first->ms_mtx);
+    }
+}
+
+/*
+ * Closes a channel. Must be called with data->fdev->mtx held. Returns true
+ * if no channel is left open.
+ */
+bool
+fuse_data_detach_channel(struct fuse_data *data, int channel)
+{
+    int i;
+    struct fuse_channel *chan = &data->channels[channel];
+
+    fuse_lck_mtx_lock(chan->ms_mtx);
+
+    chan->fdev = NULL;
+
+    /* Pairs with the barrier in fuse_insert_message(). */
+    OSMemoryBarrier();
+
+    if (channel != 0) {
+        fuse_channel_migrate(data, chan);
+    }
+
+    fuse_lck_mtx_unlock(chan->ms_mtx);
+
+    for (i = 0; i < FUSE4X_MAX_CHANNELS; i++) {
+        if (data->channels[i].fdev) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
 static __inline__
 void
 fuse_push_freeticks(struct fuse_ticket *ticket)
@@ -514,8 +853,124 @@ fuse_pop_allticks(struct fuse_data *data)
     return ticket;
 }
 
+static __inline__
+bool
+fuse_ticket_over_budget(struct fuse_data *data, bool bulk)
+{
+    if (fuse_max_tickets != 0 && data->admitted_tickets >= fuse_max_tickets) {
+        return true;
+    }
+
+    return bulk && fuse_max_bulk_tickets != 0 &&
+           data->admitted_bulk >= fuse_max_bulk_tickets;
+}
+
+/*
+ * Charges a new request to the mount's budget, sleeping while the budget is
+ * used up. Reads, writes and directory listings also count against the
+ * smaller bulk budget, so a flood of them leaves room for metadata requests.
+ * Requests that give resources back, and those sent from places that must
+ * not sleep, are never held back.
+ *
+ * Tickets are given back in fuse_ticket_drop(). A requester that is
+ * interrupted, or that sees no ticket given back for FUSE_ADMISSION_TIMEOUT,
+ * goes ahead over budget rather than wait for good: the daemon may be
+ * stuck on requests whose senders are waiting for a second ticket.
+ */
+static void
+fuse_ticket_admit(struct fuse_data *data, struct fuse_ticket *ticket,
+                  enum fuse_opcode op)
+{
+    int err = 0;
+    bool bulk;
+    struct timespec ts = { FUSE_ADMISSION_TIMEOUT, 0 };
+
+    switch (op) {
+    case FUSE_FORGET:
+    case FUSE_RELEASE:
+    case FUSE_RELEASEDIR:
+    case FUSE_INTERRUPT:
+    case FUSE_INIT:
+    case FUSE_DESTROY:
+    case FUSE_NOTIFY_REPLY:
+    case FUSE_SETLKW: /* may hold its ticket for as long as the lock is taken */
+        return;
+
+    case FUSE_READ:
+    case FUSE_WRITE:
+    case FUSE_READDIR:
+    case FUSE_READDIRPLUS:
+        bulk = true;
+        break;
+
+    default:
+        bulk = false;
+        break;
+    }
+
+    fuse_lck_mtx_lock(data->ticket_mtx);
+
+    if (fuse_ticket_over_budget(data, bulk) && !data->dead) {
+        if (bulk) {
+            OSIncrementAtomic((SInt32 *)&fuse_admission_waits_bulk);
+        } else {
+            OSIncrementAtomic((SInt32 *)&fuse_admission_waits);
+        }
+
+        /* Requesters that hold the biglock may be the ones to give tickets back. */
+        fuse_lck_mtx_unlock(data->ticket_mtx);
+#ifdef FUSE4X_ENABLE_BIGLOCK
+        fuse_biglock_unlock(data->biglock);
+#endif
+        fuse_lck_mtx_lock(data->ticket_mtx);
+
+        while (!err && !data->dead && fuse_ticket_over_budget(data, bulk)) {
+            err = fuse_msleep(&data->ticketer, data->ticket_mtx, PCATCH,
+                              "fu_adm", &ts);
+        }
+
+        fuse_lck_mtx_unlock(data->ticket_mtx);
+#ifdef FUSE4X_ENABLE_BIGLOCK
+        fuse_biglock_lock(data->biglock);
+#endif
+        fuse_lck_mtx_lock(data->ticket_mtx);
+    }
+
+    data->admitted_tickets++;
+    if (bulk) {
+        data->admitted_bulk++;
+        ticket->admission = FT_ADMIT_BULK;
+    } else {
+        ticket->admission = FT_ADMIT_METADATA;
+    }
+
+    fuse_lck_mtx_unlock(data->ticket_mtx);
+}
+
+/* Called with ticket_mtx held. */
+static __inline__
+void
+fuse_ticket_discharge(struct fuse_ticket *ticket)
+{
+    struct fuse_data *data = ticket->data;
+
+    if (ticket->admission == FT_ADMIT_NONE) {
+        return;
+    }
+
+    data->admitted_tickets--;
+    if (ticket->admission == FT_ADMIT_BULK) {
+        data->admitted_bulk--;
+    }
+    ticket->admission = FT_ADMIT_NONE;
+
+    if (fuse_max_tickets != 0 || fuse_max_bulk_tickets != 0) {
+        fuse_wakeup(&data->ticketer);
+    }
+}
+
 struct fuse_ticket *
-fuse_ticket_fetch(struct fuse_data *data)
+fuse_ticket_fetch(struct fuse_data *data, enum fuse_opcode op)
 {
     int err = 0;
     struct fuse_ticket *ticket;
@@ -542,11 +997,8 @@ fuse_ticket_fetch(struct fuse_data *data)
         err = fuse_msleep(&data->ticketer, data->ticket_mtx, PCATCH | PDROP,
                           "fu_ini", 0);
     } else {
-        if ((fuse_max_tickets != 0) &&
-            ((data->ticketer - data->deadticket_counter) > fuse_max_tickets)) {
-            err = 1;
-        }
         fuse_lck_mtx_unlock(data->ticket_mtx);
+        fuse_ticket_admit(data, ticket, op);
     }
 
     if (err) {
@@ -563,6 +1015,8 @@ fuse_ticket_drop(struct fuse_ticket *ticket)
 
     fuse_lck_mtx_lock(data->ticket_mtx);
 
+    fuse_ticket_discharge(ticket);
+
     if ((fuse_max_freetickets <= data->freeticket_counter) ||
         ticket->killed) {
         fuse_remove_allticks(ticket);
@@ -582,6 +1036,7 @@ fuse_ticket_kill(struct fuse_ticket *ticket)
 {
     struct fuse_data *data = ticket->data;
     fuse_lck_mtx_lock(data->ticket_mtx);
+    fuse_ticket_discharge(ticket);
     fuse_remove_allticks(ticket);
     fuse_lck_mtx_unlock(data->ticket_mtx);
     fuse_ticket_destroy(ticket);
@@ -595,26 +1050,330 @@ fuse_ticket_drop_invalid(struct fuse_ticket *ticket)
     }
 }
 
+/*
+ * Picks the channel for a message. Messages are spread by nodeid, so
+ * requests for the same node keep their relative order. Closed clones are
+ * skipped in favour of the first channel.
+ */
+static __inline__
+struct fuse_channel *
+fuse_channel_pick(struct fuse_data *data, struct fuse_ticket *ticket)
+{
+    struct fuse_channel *chan = &data->channels[0];
+    uint32_t slots = data->channel_slots;
+
+    if (slots > 1) {
+        uint64_t nodeid = ((struct fuse_in_header *)ticket->ms_fiov.base)->nodeid;
+
+        chan = &data->channels[(uint32_t)(nodeid ^ (nodeid >> 32)) % slots];
+        if (!chan->fdev) {
+            chan = &data->channels[0];
+        }
+    }
+
+    return chan;
+}
+
+/*
+ * Reserves the record at ring->head for a writer. Writers only take a
+ * position with an atomic increment, so a record that gets overwritten
+ * while the reader looks at it shows up with the wrong seq.
+ */
+void *
+fuse_ring_reserve(struct fuse_ring *ring, uint64_t *pos)
+{
+    uint64_t *record;
+
+    *pos = (uint64_t)OSIncrementAtomic64((volatile SInt64 *)&ring->head);
+    record = (uint64_t *)((char *)ring->records + (*pos & ring->mask) * ring->recsize);
+
+    *record = 0;
+    OSMemoryBarrier();
+
+    return record;
+}
+
 void
-fuse_insert_callback(struct fuse_ticket *ticket, fuse_callback_t *callback)
+fuse_ring_commit(void *record, uint64_t pos)
 {
-    struct fuse_data *data = ticket->data;
+    OSMemoryBarrier();
+    *(uint64_t *)record = pos + 1;
+}
 
-    if (data->dead) {
-        return;
+/*
+ * Turns a ring on (nrecords rounded up to a power of two) or off (0). The
+ * records are allocated the first time and kept until fuse_ring_free(), so
+ * writers never see them go away. Must be called with data->fdev->mtx held.
+ */
+int
+fuse_ring_setup(struct fuse_ring *ring, uint32_t recsize, uint32_t nrecords,
+                uint32_t maxrecords)
+{
+    uint32_t size = 1;
+    void *records;
+
+    if (nrecords == 0) {
+        ring->enabled = false;
+        return 0;
+    }
+
+    if (nrecords > maxrecords) {
+        return EINVAL;
+    }
+
+    if (!ring->records) {
+        while (size < nrecords) {
+            size <<= 1;
+        }
+
+        records = FUSE_OSMalloc(size * recsize, fuse_malloc_tag);
+        if (!records) {
+            return ENOMEM;
+        }
+        bzero(records, size * recsize);
+
+        ring->recsize = recsize;
+        ring->mask    = size - 1;
+        ring->head    = 0;
+        ring->tail    = 0;
+        ring->records = records;
+    }
+
+    /* The records have to be visible before anybody logs into them. */
+    OSMemoryBarrier();
+    ring->enabled = true;
+
+    return 0;
+}
+
+/* Bytes a ring reader stages at a time before copying them out. */
+#define FUSE_RING_CHUNK (64 * 1024)
+
+/*
+ * Copies the records logged since the last call out to req->buf, stopping
+ * at the first record that is still being written. Must be called with
+ * mtx, data->fdev->mtx, held; it is dropped while records are copied out,
+ * FUSE_RING_CHUNK bytes at a time, so the device is not held up. One
+ * reader at a time, and fuse_ring_drain() keeps the records around for it.
+ */
+int
+fuse_ring_read(struct fuse_ring *ring, struct fuse_trace_read *req,
+               lck_mtx_t *mtx)
+{
+    int err = 0;
+    uint32_t n = 0;
+    uint32_t staged;
+    uint32_t chunk;
+    uint32_t count = req->count;
+    uint64_t seq;
+    uint64_t head;
+    uint64_t tail;
+    uint64_t from;
+    uint64_t size;
+    char *out;
+    char *record;
+    bool busy = true;
+
+    req->returned = 0;
+    req->lost     = 0;
+
+    if (ring->reading) {
+        return EBUSY;
+    }
+
+    if (!ring->records || count == 0) {
+        return 0;
+    }
+
+    size = (uint64_t)ring->mask + 1;
+    if (count > size) {
+        count = (uint32_t)size;
+    }
+
+    chunk = FUSE_RING_CHUNK / ring->recsize;
+    if (chunk == 0) {
+        chunk = 1;
+    }
+    if (chunk > count) {
+        chunk = count;
     }
 
-    ticket->aw_callback = callback;
+    tail = ring->tail;
+    head = ring->head;
+    if (head - tail > size) {
+        req->lost = head - tail - size;
+        tail = head - size;
+    }
+
+    ring->reading = true;
+    fuse_lck_mtx_unlock(mtx);
+
+    out = FUSE_OSMalloc(chunk * ring->recsize, fuse_malloc_tag);
+    if (!out) {
+        err = ENOMEM;
+        busy = false;
+    }
+
+    while (busy && n < count) {
+        staged = 0;
+        from = tail;
+
+        while (tail < head && n + staged < count && staged < chunk) {
+            record = (char *)ring->records + (tail & ring->mask) * ring->recsize;
+            seq = *(volatile uint64_t *)record;
+            OSMemoryBarrier();
+            memcpy(out + staged * ring->recsize, record, ring->recsize);
+            OSMemoryBarrier();
+            if (seq == tail + 1 && *(volatile uint64_t *)record == tail + 1) {
+                staged++;
+            } else if (ring->head - tail <= size) {
+                /* Still being written, pick it up next time. */
+                busy = false;
+                break;
+            } else {
+                req->lost++;
+            }
+            tail++;
+        }
+
+        if (staged == 0) {
+            break;
+        }
+
+        err = copyout(out, (user_addr_t)(req->buf + (uint64_t)n * ring->recsize),
+                      staged * ring->recsize);
+        if (err) {
+            /* Leave these for the next read. */
+            tail = from;
+            break;
+        }
+        n += staged;
+
+        if (tail == head) {
+            break;
+        }
+    }
+
+    if (out) {
+        FUSE_OSFree(out, chunk * ring->recsize, fuse_malloc_tag);
+    }
+
+    fuse_lck_mtx_lock(mtx);
+    ring->tail = tail;
+    ring->reading = false;
+    fuse_wakeup(ring);
+
+    req->returned = n;
+
+    return err;
+}
+
+/*
+ * Waits for a reader that is copying records out. Must be called with
+ * mtx, data->fdev->mtx, held before the records are freed.
+ */
+void
+fuse_ring_drain(struct fuse_ring *ring, lck_mtx_t *mtx)
+{
+    while (ring->reading) {
+        fuse_msleep(ring, mtx, 0, "fu_ring", NULL);
+    }
+}
+
+void
+fuse_ring_free(struct fuse_ring *ring)
+{
+    if (ring->records) {
+        FUSE_OSFree(ring->records, (ring->mask + 1) * ring->recsize,
+                    fuse_malloc_tag);
+        ring->records = NULL;
+    }
+    ring->enabled = false;
+}
+
+/* Logs an event of ticket's request into the trace ring. */
+void
+fuse_trace_event(struct fuse_ticket *ticket, uint32_t event, int result)
+{
+    struct fuse_in_header *ihead = ticket->ms_fiov.base;
+    struct fuse_trace_record *rec;
+    uint64_t now = mach_absolute_time();
+    uint64_t pos;
+    uint64_t ns;
+
+    switch (event) {
+    case FUSE4X_TRACE_SUBMIT:
+        ticket->trace_submitted = now;
+        ticket->trace_dequeued  = 0;
+        break;
+    case FUSE4X_TRACE_DEQUEUE:
+        ticket->trace_dequeued = now;
+        break;
+    }
+
+    rec = fuse_ring_reserve(&ticket->data->trace, &pos);
+
+    absolutetime_to_nanoseconds(now, &ns);
+    rec->time         = ns;
+    rec->unique       = ihead->unique;
+    rec->nodeid       = ihead->nodeid;
+    rec->event        = event;
+    rec->opcode       = ihead->opcode;
+    rec->pid          = ihead->pid;
+    rec->size         = (uint32_t)ticket->ms_fiov.len +
+                        (ticket->ms_type == FT_M_BUF ? (uint32_t)ticket->ms_bufsize : 0);
+    rec->queue_wait   = 0;
+    rec->service_time = 0;
+    rec->result       = result;
+
+    if (event != FUSE4X_TRACE_SUBMIT && ticket->trace_submitted &&
+        ticket->trace_dequeued) {
+        absolutetime_to_nanoseconds(ticket->trace_dequeued - ticket->trace_submitted, &ns);
+        rec->queue_wait = ns > UINT32_MAX ? UINT32_MAX : (uint32_t)ns;
+    }
+    if (event == FUSE4X_TRACE_REPLY && ticket->trace_dequeued) {
+        absolutetime_to_nanoseconds(now - ticket->trace_dequeued, &ns);
+        rec->service_time = ns > UINT32_MAX ? UINT32_MAX : (uint32_t)ns;
+    }
+
+    fuse_ring_commit(rec, pos);
+}
+
+/*
+ * Logs a message crossing the device into the capture ring. msg holds the
+ * first avail bytes of a message that is length bytes long.
+ */
+void
+fuse_capture_event(struct fuse_data *data, uint32_t direction,
+                   const void *msg, size_t avail, uint32_t length)
+{
+    struct fuse_capture_record *rec;
+    uint64_t pos;
+    uint64_t ns;
+    size_t captured = avail;
+
+    if (captured > FUSE4X_CAPTURE_BYTES) {
+        captured = FUSE4X_CAPTURE_BYTES;
+    }
 
-    fuse_lck_mtx_lock(data->aw_mtx);
-    TAILQ_INSERT_TAIL(&data->aw_head, ticket, aw_link);
-    fuse_lck_mtx_unlock(data->aw_mtx);
+    rec = fuse_ring_reserve(&data->capture, &pos);
+
+    absolutetime_to_nanoseconds(mach_absolute_time(), &ns);
+    rec->time      = ns;
+    rec->direction = direction;
+    rec->length    = length;
+    rec->captured  = (uint32_t)captured;
+    rec->reserved  = 0;
+    memcpy(rec->data, msg, captured);
+
+    fuse_ring_commit(rec, pos);
 }
 
 void
 fuse_insert_message(struct fuse_ticket *ticket)
 {
     struct fuse_data *data = ticket->data;
+    struct fuse_channel *chan;
 
     if (ticket->dirty) {
         panic("fuse4x: ticket reused without being refreshed");
@@ -626,10 +1385,85 @@ fuse_insert_message(struct fuse_ticket *ticket)
         return;
     }
 
-    fuse_lck_mtx_lock(data->ms_mtx);
-    STAILQ_INSERT_TAIL(&data->ms_head, ticket, ms_link);
-    fuse_wakeup_one((caddr_t)data);
-    fuse_lck_mtx_unlock(data->ms_mtx);
+    chan = fuse_channel_pick(data, ticket);
+
+    fuse_trace_ticket(ticket, FUSE4X_TRACE_SUBMIT, 0);
+
+    do {
+        ticket->ms_pending_link = chan->ms_pending;
+    } while (!OSCompareAndSwapPtr(ticket->ms_pending_link, ticket,
+                                  (void * volatile *)&chan->ms_pending));
+
+    /*
+     * The push has to be visible before we look at fdev and ms_sleepers, or
+     * a reader that is about to sleep and we could both miss each other.
+     */
+    OSMemoryBarrier();
+
+    if (!chan->fdev && chan != &data->channels[0]) {
+        /* The clone was closed while we were pushing. */
+        fuse_lck_mtx_lock(chan->ms_mtx);
+        fuse_channel_migrate(data, chan);
+        fuse_lck_mtx_unlock(chan->ms_mtx);
+    } else if (chan->ms_sleepers > chan->ms_woken) {
+        /*
+         * Taking ms_mtx makes sure the reader is really asleep and not
+         * between its last look at the queue and fuse_msleep(). A reader
+         * that has been woken up already collects everything pending when
+         * it runs, so a burst of messages costs a single wakeup.
+         */
+        fuse_lck_mtx_lock(chan->ms_mtx);
+        if (chan->ms_sleepers > chan->ms_woken) {
+            chan->ms_woken++;
+            fuse_wakeup_one((caddr_t)chan);
+        }
+        fuse_lck_mtx_unlock(chan->ms_mtx);
+    }
+}
+
+/*
+ * Queues a message that expects an answer. The ticket is registered on
+ * aw_pending before the message is pushed, so it can always be found by
+ * the time the daemon answers. Neither step takes a lock.
+ */
+void
+fuse_insert_request(struct fuse_ticket *ticket, fuse_callback_t *callback)
+{
+    struct fuse_data *data = ticket->data;
+
+    if (!data->dead) {
+        ticket->aw_callback = callback;
+
+        do {
+            ticket->aw_pending_link = data->aw_pending;
+        } while (!OSCompareAndSwapPtr(ticket->aw_pending_link, ticket,
+                                      (void * volatile *)&data->aw_pending));
+    }
+
+    fuse_insert_message(ticket);
+}
+
+/*
+ * Moves newly registered requests to the end of aw_head, oldest first.
+ * Must be called with data->aw_mtx held.
+ */
+void
+fuse_collect_requests(struct fuse_data *data)
+{
+    struct fuse_ticket *top;
+    struct fuse_ticket *ticket;
+    TAILQ_HEAD(, fuse_ticket) batch = TAILQ_HEAD_INITIALIZER(batch);
+
+    do {
+        top = data->aw_pending;
+    } while (top && !OSCompareAndSwapPtr(top, NULL, (void * volatile *)&data->aw_pending));
+
+    while ((ticket = top)) {
+        top = ticket->aw_pending_link;
+        TAILQ_INSERT_HEAD(&batch, ticket, aw_link);
+    }
+
+    TAILQ_CONCAT(&data->aw_head, &batch, aw_link);
 }
 
 static int
@@ -757,6 +1591,7 @@ fuse_body_audit(struct fuse_ticket *ticket, size_t blen)
         break;
 
     case FUSE_READDIR:
+    case FUSE_READDIRPLUS:
         err = (((struct fuse_read_in *)(
                 (char *)ticket->ms_fiov.base +
                         sizeof(struct fuse_in_header)
@@ -772,15 +1607,15 @@ fuse_body_audit(struct fuse_ticket *ticket, size_t blen)
         break;
 
     case FUSE_GETLK:
-        panic("fuse4x: no response body format check for FUSE_GETLK");
+        err = (blen == sizeof(struct fuse_lk_out)) ? 0 : EINVAL;
         break;
 
     case FUSE_SETLK:
-        panic("fuse4x: no response body format check for FUSE_SETLK");
+        err = (blen == 0) ? 0 : EINVAL;
         break;
 
     case FUSE_SETLKW:
-        panic("fuse4x: no response body format check for FUSE_SETLKW");
+        err = (blen == 0) ? 0 : EINVAL;
         break;
 
     case FUSE_ACCESS:
@@ -808,6 +1643,10 @@ fuse_body_audit(struct fuse_ticket *ticket, size_t blen)
         err = (blen == 0) ? 0 : EINVAL;
         break;
 
+    case FUSE_FALLOCATE:
+        err = (blen == 0) ? 0 : EINVAL;
+        break;
+
     case FUSE_EXCHANGE:
         err = (blen == 0) ? 0 : EINVAL;
         break;
@@ -888,7 +1727,7 @@ fuse_dispatcher_make(struct fuse_dispatcher *dispatcher,
     if (dispatcher->ticket) {
         fuse_ticket_refresh(dispatcher->ticket);
     } else {
-        dispatcher->ticket = fuse_ticket_fetch(data);
+        dispatcher->ticket = fuse_ticket_fetch(data, op);
     }
 
     if (!dispatcher->ticket) {
@@ -916,7 +1755,7 @@ fuse_dispatcher_make_canfail(struct fuse_dispatcher *dispatcher,
     if (dispatcher->ticket) {
         fuse_ticket_refresh(dispatcher->ticket);
     } else {
-        dispatcher->ticket = fuse_ticket_fetch(data);
+        dispatcher->ticket = fuse_ticket_fetch(data, op);
     }
 
     if (dispatcher->ticket == 0) {
@@ -967,8 +1806,7 @@ fuse_dispatcher_wait_answer(struct fuse_dispatcher *dispatcher)
     struct fuse_ticket *ticket = dispatcher->ticket;
 
     dispatcher->answer_errno = 0;
-    fuse_insert_callback(ticket, fuse_standard_callback);
-    fuse_insert_message(ticket);
+    fuse_insert_request(ticket, fuse_standard_callback);
 
     if ((err = fuse_ticket_wait_answer(ticket))) { /* interrupted */
         fuse_lck_mtx_lock(ticket->aw_mtx);
@@ -13,6 +13,8 @@
 #include "fuse_locking.h"
 #include "compat/tree.h"
 
+#include <fuse_trace.h>
+
 #include <kern/assert.h>
 #include <libkern/libkern.h>
 #include <libkern/OSMalloc.h>
@@ -56,6 +58,7 @@ do {                                                   \
 
 struct fuse_ticket;
 struct fuse_data;
+struct fuse_flight;
 
 typedef int fuse_callback_t(struct fuse_ticket *ticket, uio_t uio);
 
@@ -68,6 +71,8 @@ struct fuse_ticket {
     bool                         dirty: 1; // ticket has been used
     bool                         killed: 1; // ticket has been marked for death (KILLL => KILL_LATER)
 
+    enum { FT_ADMIT_NONE, FT_ADMIT_METADATA, FT_ADMIT_BULK } admission; // budget the ticket is charged to, protected by ticket_mtx
+
     STAILQ_ENTRY(fuse_ticket)    freetickets_link;
     TAILQ_ENTRY(fuse_ticket)     alltickets_link;
 
@@ -76,6 +81,7 @@ struct fuse_ticket {
     size_t                       ms_bufsize;
     enum { FT_M_FIOV, FT_M_BUF } ms_type;
     STAILQ_ENTRY(fuse_ticket)    ms_link;
+    struct fuse_ticket          *ms_pending_link; // next older ticket in fuse_channel.ms_pending
 
     struct fuse_iov              aw_fiov;
     void                        *aw_bufdata;
@@ -87,6 +93,12 @@ struct fuse_ticket {
     lck_mtx_t                   *aw_mtx;
     fuse_callback_t             *aw_callback;
     TAILQ_ENTRY(fuse_ticket)     aw_link;
+    struct fuse_ticket          *aw_pending_link; // next older ticket in fuse_data.aw_pending
+
+    uint32_t                     attr_epoch; // attr_epoch of the node an attribute prefetch was sent for
+
+    uint64_t                     trace_submitted; // mach_absolute_time() of the last submit, if traced
+    uint64_t                     trace_dequeued; // mach_absolute_time() of the last dequeue, if traced
 };
 
 static __inline__
@@ -99,6 +111,63 @@ fuse_ticket_opcode(struct fuse_ticket *ticket)
 
 int fuse_ticket_pull(struct fuse_ticket *ticket, uio_t uio);
 
+/* Messages of the processes that hash to one fair queuing slot. */
+struct fuse_flow {
+    STAILQ_HEAD(, fuse_ticket) queue;
+    TAILQ_ENTRY(fuse_flow)     active_link; // in fuse_channel.ms_active while queue is not empty
+    uint32_t                   deficit; // bytes the flow may still send in this round
+    pid_t                      pid;
+    uint32_t                   queued;
+    uint32_t                   served;
+};
+
+/*
+ * Requesters never take ms_mtx: they push messages onto ms_pending with a
+ * compare-and-swap. Readers hold ms_mtx, sort whatever is pending into the
+ * flows in arrival order and take messages from the flows in deficit round
+ * robin order.
+ */
+struct fuse_channel {
+    fuse_device_t              fdev; // NULL if the channel is closed, written under ms_mtx
+    lck_mtx_t                 *ms_mtx;
+    struct fuse_ticket        *ms_pending; // lock-free stack, newest first
+    struct fuse_flow           ms_flows[FUSE4X_FAIR_FLOWS]; // protected by ms_mtx
+    TAILQ_HEAD(, fuse_flow)    ms_active; // flows with messages, protected by ms_mtx
+    uint32_t                   ms_sleepers; // readers waiting for a message, written under ms_mtx
+    uint32_t                   ms_woken; // sleepers already woken up but not running yet, written under ms_mtx
+};
+
+void fuse_channel_collect(struct fuse_channel *chan);
+struct fuse_ticket *fuse_channel_dequeue(struct fuse_data *data, struct fuse_channel *chan);
+
+static __inline__
+bool
+fuse_channel_empty(struct fuse_channel *chan)
+{
+    return TAILQ_EMPTY(&chan->ms_active);
+}
+
+/*
+ * A ring of fixed-size records, each starting with a uint64_t sequence
+ * number, that user space drains through an ioctl. Writers never block.
+ */
+struct fuse_ring {
+    void                      *records; // allocated on first use, freed with the data
+    uint32_t                   recsize;
+    uint32_t                   mask;    // records in the ring minus one
+    bool                       enabled;
+    uint64_t                   head;    // next record to write, advanced atomically
+    uint64_t                   tail;    // next record to read, protected by fdev->mtx
+    bool                       reading; // a reader is copying out without fdev->mtx
+};
+
+void *fuse_ring_reserve(struct fuse_ring *ring, uint64_t *pos);
+void  fuse_ring_commit(void *record, uint64_t pos);
+int   fuse_ring_setup(struct fuse_ring *ring, uint32_t recsize, uint32_t nrecords, uint32_t maxrecords);
+int   fuse_ring_read(struct fuse_ring *ring, struct fuse_trace_read *req, lck_mtx_t *mtx);
+void  fuse_ring_drain(struct fuse_ring *ring, lck_mtx_t *mtx);
+void  fuse_ring_free(struct fuse_ring *ring);
+
 struct fuse_data {
     fuse_device_t              fdev;
     mount_t                    mp;
@@ -113,11 +182,13 @@ struct fuse_data {
     bool                       inited: 1;
     bool                       dead: 1;
 
-    lck_mtx_t                 *ms_mtx;
-    STAILQ_HEAD(, fuse_ticket) ms_head;
+    // channels[0] is the device the daemon opened first, the rest are clones
+    struct fuse_channel        channels[FUSE4X_MAX_CHANNELS];
+    uint32_t                   channel_slots; // number of channel slots ever used, protected by fdev->mtx
 
     lck_mtx_t                 *aw_mtx;
-    TAILQ_HEAD(, fuse_ticket)  aw_head;
+    TAILQ_HEAD(, fuse_ticket)  aw_head; // protected by aw_mtx
+    struct fuse_ticket        *aw_pending; // lock-free stack of new requests, newest first
 
     lck_mtx_t                 *ticket_mtx;
     STAILQ_HEAD(, fuse_ticket) freetickets_head; // protected by ticket_mtx
@@ -125,6 +196,8 @@ struct fuse_data {
     uint32_t                   freeticket_counter; // protected by ticket_mtx
     uint32_t                   deadticket_counter; // protected by ticket_mtx
     uint64_t                   ticketer; // protected by ticket_mtx
+    uint32_t                   admitted_tickets; // outstanding tickets charged to a budget, protected by ticket_mtx
+    uint32_t                   admitted_bulk; // those of them for bulk data, protected by ticket_mtx
 
     uint32_t                   max_write;
     uint32_t                   max_read;
@@ -142,6 +215,16 @@ struct fuse_data {
 
     lck_mtx_t                                *node_mtx;
     RB_HEAD(fuse_data_nodes, fuse_vnode_data) nodes_head; // map ino->vnode_data
+
+    struct fuse_statfs_out     statfs_cache;   // protected by node_mtx
+    struct timespec            statfs_expires; // protected by node_mtx
+    LIST_HEAD(, fuse_flight)   flights;        // upcalls in flight that others may join, protected by node_mtx
+
+    uint32_t                   svc_time[FUSE_SVC_TIME_OPCODES]; // average answer latency in ns, updated racily
+    uint32_t                   flow_weights[FUSE4X_FAIR_FLOWS]; // set through FUSEDEVIOCSETWEIGHT
+
+    struct fuse_ring           trace;   // struct fuse_trace_record
+    struct fuse_ring           capture; // struct fuse_capture_record
 };
 
 /* Not-Implemented Bits */
@@ -171,7 +254,14 @@ enum {
     FSESS_AUTO_CACHE          = 1 << 20,
     FSESS_NATIVE_XATTR        = 1 << 21,
     FSESS_SPARSE              = 1 << 22,
-    FSESS_ATOMIC_O_TRUNC      = 1 << 23
+    FSESS_ATOMIC_O_TRUNC      = 1 << 23,
+    FSESS_READDIRPLUS         = 1 << 24,
+    FSESS_WRITEBACK_CACHE     = 1 << 25,
+    FSESS_SPIN_WAIT           = 1 << 26,
+    FSESS_LOCAL_LOCKS         = 1 << 27, // the VFS keeps advisory locks
+    FSESS_POSIX_LOCKS         = 1 << 28, // the daemon keeps advisory locks
+    FSESS_FLOCK_LOCKS         = 1 << 29, // the daemon keeps flock(2) locks too
+    FSESS_WRITEBACK_OPT       = 1 << 30  // mounted with writeback_cache
 };
 
 static __inline__
@@ -184,16 +274,42 @@ fuse_get_mpdata(mount_t mp)
     return (struct fuse_data *)vfs_fsprivate(mp);
 }
 
-struct fuse_ticket *fuse_ticket_fetch(struct fuse_data *data);
+struct fuse_ticket *fuse_ticket_fetch(struct fuse_data *data, enum fuse_opcode op);
 void fuse_ticket_drop(struct fuse_ticket *ticket);
 void fuse_ticket_drop_invalid(struct fuse_ticket *ticket);
 void fuse_ticket_kill(struct fuse_ticket *ticket);
-void fuse_insert_callback(struct fuse_ticket *ticket, fuse_callback_t *callback);
 void fuse_insert_message(struct fuse_ticket *ticket);
+void fuse_insert_request(struct fuse_ticket *ticket, fuse_callback_t *callback);
+void fuse_collect_requests(struct fuse_data *data);
+
+void fuse_trace_event(struct fuse_ticket *ticket, uint32_t event, int result);
+void fuse_capture_event(struct fuse_data *data, uint32_t direction,
+                        const void *msg, size_t avail, uint32_t length);
+
+static __inline__
+void
+fuse_trace_ticket(struct fuse_ticket *ticket, uint32_t event, int result)
+{
+    if (ticket->data->trace.enabled) {
+        fuse_trace_event(ticket, event, result);
+    }
+}
+
+static __inline__
+void
+fuse_capture_message(struct fuse_data *data, uint32_t direction,
+                     const void *msg, size_t avail, uint32_t length)
+{
+    if (data->capture.enabled) {
+        fuse_capture_event(data, direction, msg, avail, length);
+    }
+}
 
 struct fuse_data *fuse_data_alloc(struct proc *p);
 void fuse_data_destroy(struct fuse_data *data);
 bool fuse_data_kill(struct fuse_data *data);
+int  fuse_data_attach_channel(struct fuse_data *data, fuse_device_t fdev);
+bool fuse_data_detach_channel(struct fuse_data *data, int channel);
 
 struct fuse_dispatcher {
 
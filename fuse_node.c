@@ -31,9 +31,55 @@ static int fuse_vnode_compare(struct fuse_vnode_data *d1, struct fuse_vnode_data
 
 RB_GENERATE(fuse_data_nodes, fuse_vnode_data, nodes_link, fuse_vnode_compare);
 
+static void
+fuse_dircache_free(struct fuse_vnode_data *fvdat)
+{
+    struct fuse_dirpage *page;
+
+    while ((page = fvdat->dirpages)) {
+        fvdat->dirpages = page->next;
+        FUSE_OSFree(page, sizeof(*page) + page->size, fuse_malloc_tag);
+    }
+    fvdat->dirpages_size = 0;
+}
+
+static void
+fuse_xattrcache_free(struct fuse_vnode_data *fvdat)
+{
+    struct fuse_xattr *xa;
+
+    while ((xa = fvdat->xattrs)) {
+        fvdat->xattrs = xa->next;
+        FUSE_OSFree(xa, sizeof(*xa) + xa->namelen + 1 + xa->size,
+                    fuse_malloc_tag);
+    }
+
+    if (fvdat->xattr_names) {
+        FUSE_OSFree(fvdat->xattr_names, fvdat->xattr_names_size,
+                    fuse_malloc_tag);
+        fvdat->xattr_names = NULL;
+    }
+    fvdat->xattr_names_size = 0;
+    fvdat->xattr_names_valid = false;
+}
+
 void
 fuse_vnode_data_destroy(struct fuse_vnode_data *fvdat)
 {
+    fuse_xattrcache_free(fvdat);
+    fuse_dircache_free(fvdat);
+
+    if (fvdat->link_target) {
+        FUSE_OSFree(fvdat->link_target, fvdat->link_target_size,
+                    fuse_malloc_tag);
+    }
+
+    for (int i = 0; i < FUSE_ACCESS_CACHE_SIZE; i++) {
+        if (fvdat->access_cache[i].cred) {
+            kauth_cred_unref(&fvdat->access_cache[i].cred);
+        }
+    }
+
 #ifdef FUSE4X_ENABLE_TSLOCKING
     lck_rw_free(fvdat->nodelock, fuse_lock_group);
     lck_rw_free(fvdat->truncatelock, fuse_lock_group);
@@ -271,3 +317,325 @@ fuse_vget_i(vnode_t               *vpp,
 
     return 0;
 }
+
+/* readdir cache */
+
+void
+fuse_dircache_purge(vnode_t vp)
+{
+    struct fuse_vnode_data *fvdat = VTOFUD(vp);
+
+    if (fvdat) {
+        fuse_dircache_free(fvdat);
+    }
+}
+
+/*
+ * Marks the readdir cache stale without the nodelock; the next readdir
+ * empties it and pages fetched before then are not kept.
+ */
+void
+fuse_dircache_invalidate(vnode_t vp)
+{
+    struct fuse_vnode_data *fvdat = VTOFUD(vp);
+
+    if (fvdat) {
+        OSIncrementAtomic((SInt32 *)&fvdat->dirpages_gen);
+    }
+}
+
+bool
+fuse_dircache_lookup(vnode_t vp, off_t offset, void **bufp, size_t *sizep)
+{
+    struct fuse_vnode_data *fvdat = VTOFUD(vp);
+    struct fuse_dirpage *page;
+
+    for (page = fvdat->dirpages; page; page = page->next) {
+        if (page->offset == offset) {
+            *bufp = page->buf;
+            *sizep = page->size;
+            return true;
+        }
+    }
+
+    /*
+     * A previous readdir may have stopped in the middle of a page because
+     * the caller's buffer was full. Resume right after the entry whose
+     * cookie matches. Only non-empty tails count: an empty one says nothing
+     * about what follows the page.
+     */
+    for (page = fvdat->dirpages; page; page = page->next) {
+        char *buf = page->buf;
+        size_t left = page->size;
+
+        while (left >= FUSE_NAME_OFFSET) {
+            struct fuse_dirent *fudge = (struct fuse_dirent *)buf;
+            size_t freclen = FUSE_DIRENT_SIZE(fudge);
+
+            if (freclen > left) {
+                break;
+            }
+            buf += freclen;
+            left -= freclen;
+
+            if ((off_t)fudge->off == offset && left > 0) {
+                *bufp = buf;
+                *sizep = left;
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+void
+fuse_dircache_store(vnode_t vp, off_t offset, void *buf, size_t size)
+{
+    struct fuse_vnode_data *fvdat = VTOFUD(vp);
+    struct fuse_dirpage *page;
+
+    if (fvdat->dirpages_size + size > (size_t)fuse_dircache_maxsize ||
+        fvdat->dirpages_seen != fvdat->dirpages_gen) {
+        return;
+    }
+
+    page = FUSE_OSMalloc(sizeof(*page) + size, fuse_malloc_tag);
+    if (!page) {
+        return;
+    }
+
+    page->offset = offset;
+    page->size = size;
+    memcpy(page->buf, buf, size);
+
+    page->next = fvdat->dirpages;
+    fvdat->dirpages = page;
+    fvdat->dirpages_size += size;
+}
+
+/*
+ * xattr cache
+ *
+ * Values and the listxattr snapshot stay valid for as long as the
+ * attributes that were cached when they came in. Setting or removing an
+ * extended attribute throws everything away. Callers get private copies
+ * since nothing may be copied to user space under node_mtx.
+ */
+
+static void *
+fuse_xattrcache_copy(const void *src, size_t size)
+{
+    void *buf = NULL;
+
+    if (size > 0) {
+        buf = FUSE_OSMalloc(size, fuse_malloc_tag);
+        if (buf) {
+            memcpy(buf, src, size);
+        }
+    }
+
+    return buf;
+}
+
+static bool
+fuse_xattrcache_expiry(vnode_t vp, struct timespec *expires)
+{
+    struct timespec uptsp;
+
+    if (fuse_xattrcache_maxsize == 0) {
+        return false;
+    }
+
+    nanouptime(&uptsp);
+    *expires = VTOFUD(vp)->attr_valid;
+
+    return fuse_timespec_cmp(&uptsp, expires, <);
+}
+
+void
+fuse_xattrcache_purge(vnode_t vp)
+{
+    struct fuse_vnode_data *fvdat = VTOFUD(vp);
+    struct fuse_data *data = fuse_get_mpdata(vnode_mount(vp));
+
+    fuse_lck_mtx_lock(data->node_mtx);
+    fuse_xattrcache_free(fvdat);
+    fuse_lck_mtx_unlock(data->node_mtx);
+}
+
+/*
+ * Answers getxattr of name from the cache. *errp is ENOATTR if the
+ * listxattr snapshot says there is no such attribute. Otherwise it is 0 and
+ * *bufp holds a copy of the value to be released with FUSE_OSFree.
+ */
+bool
+fuse_xattrcache_lookup(vnode_t vp, const char *name, void **bufp,
+                       size_t *sizep, int *errp)
+{
+    bool hit = false;
+    struct timespec uptsp;
+    struct fuse_xattr *xa;
+    struct fuse_vnode_data *fvdat = VTOFUD(vp);
+    struct fuse_data *data = fuse_get_mpdata(vnode_mount(vp));
+    size_t namelen = strlen(name);
+
+    nanouptime(&uptsp);
+
+    fuse_lck_mtx_lock(data->node_mtx);
+
+    for (xa = fvdat->xattrs; xa; xa = xa->next) {
+        if (xa->namelen == namelen && !memcmp(xa->data, name, namelen) &&
+            fuse_timespec_cmp(&uptsp, &xa->expires, <) &&
+            xa->epoch == fvdat->attr_epoch) {
+            *bufp = fuse_xattrcache_copy(xa->data + namelen + 1, xa->size);
+            if (*bufp || xa->size == 0) {
+                *sizep = xa->size;
+                *errp = 0;
+                hit = true;
+            }
+            goto out;
+        }
+    }
+
+    if (fvdat->xattr_names_valid &&
+        fuse_timespec_cmp(&uptsp, &fvdat->xattr_names_expires, <) &&
+        fvdat->xattr_names_epoch == fvdat->attr_epoch) {
+        char *p = fvdat->xattr_names;
+        char *end = p + fvdat->xattr_names_size;
+
+        while (p < end) {
+            char *q = p;
+            while (q < end && *q) {
+                q++;
+            }
+            if ((size_t)(q - p) == namelen && !memcmp(p, name, namelen)) {
+                goto out;
+            }
+            p = q + 1;
+        }
+
+        *errp = ENOATTR;
+        hit = true;
+    }
+
+out:
+    fuse_lck_mtx_unlock(data->node_mtx);
+
+    return hit;
+}
+
+/*
+ * epoch is the node's attr_epoch from before the value was asked for; an
+ * attribute invalidation since then, or later, makes the entry stale.
+ */
+void
+fuse_xattrcache_store(vnode_t vp, const char *name, const void *value,
+                      size_t size, uint32_t epoch)
+{
+    struct timespec expires;
+    struct fuse_xattr *xa, **xap;
+    struct fuse_vnode_data *fvdat = VTOFUD(vp);
+    struct fuse_data *data = fuse_get_mpdata(vnode_mount(vp));
+    size_t namelen = strlen(name);
+
+    if (size > fuse_xattrcache_maxsize || !fuse_xattrcache_expiry(vp, &expires)) {
+        return;
+    }
+
+    xa = FUSE_OSMalloc(sizeof(*xa) + namelen + 1 + size, fuse_malloc_tag);
+    if (!xa) {
+        return;
+    }
+
+    xa->expires = expires;
+    xa->epoch = epoch;
+    xa->namelen = namelen;
+    xa->size = size;
+    memcpy(xa->data, name, namelen + 1);
+    memcpy(xa->data + namelen + 1, value, size);
+
+    fuse_lck_mtx_lock(data->node_mtx);
+
+    /* Replace any older copy. */
+    for (xap = &fvdat->xattrs; *xap; xap = &(*xap)->next) {
+        struct fuse_xattr *old = *xap;
+        if (old->namelen == namelen && !memcmp(old->data, name, namelen)) {
+            *xap = old->next;
+            FUSE_OSFree(old, sizeof(*old) + old->namelen + 1 + old->size,
+                        fuse_malloc_tag);
+            break;
+        }
+    }
+
+    xa->next = fvdat->xattrs;
+    fvdat->xattrs = xa;
+
+    fuse_lck_mtx_unlock(data->node_mtx);
+}
+
+bool
+fuse_xattrcache_list(vnode_t vp, void **bufp, size_t *sizep)
+{
+    bool hit = false;
+    struct timespec uptsp;
+    struct fuse_vnode_data *fvdat = VTOFUD(vp);
+    struct fuse_data *data = fuse_get_mpdata(vnode_mount(vp));
+
+    nanouptime(&uptsp);
+
+    fuse_lck_mtx_lock(data->node_mtx);
+
+    if (fvdat->xattr_names_valid &&
+        fuse_timespec_cmp(&uptsp, &fvdat->xattr_names_expires, <) &&
+        fvdat->xattr_names_epoch == fvdat->attr_epoch) {
+        *bufp = fuse_xattrcache_copy(fvdat->xattr_names,
+                                     fvdat->xattr_names_size);
+        if (*bufp || fvdat->xattr_names_size == 0) {
+            *sizep = fvdat->xattr_names_size;
+            hit = true;
+        }
+    }
+
+    fuse_lck_mtx_unlock(data->node_mtx);
+
+    return hit;
+}
+
+void
+fuse_xattrcache_store_list(vnode_t vp, const void *names, size_t size,
+                           uint32_t epoch)
+{
+    char *buf;
+    char *oldbuf;
+    size_t oldsize;
+    struct timespec expires;
+    struct fuse_vnode_data *fvdat = VTOFUD(vp);
+    struct fuse_data *data = fuse_get_mpdata(vnode_mount(vp));
+
+    if (size > fuse_xattrcache_maxsize || !fuse_xattrcache_expiry(vp, &expires)) {
+        return;
+    }
+
+    buf = fuse_xattrcache_copy(names, size);
+    if (!buf && size > 0) {
+        return;
+    }
+
+    fuse_lck_mtx_lock(data->node_mtx);
+
+    oldbuf = fvdat->xattr_names;
+    oldsize = fvdat->xattr_names_size;
+
+    fvdat->xattr_names = buf;
+    fvdat->xattr_names_size = size;
+    fvdat->xattr_names_valid = true;
+    fvdat->xattr_names_expires = expires;
+    fvdat->xattr_names_epoch = epoch;
+
+    fuse_lck_mtx_unlock(data->node_mtx);
+
+    if (oldbuf) {
+        FUSE_OSFree(oldbuf, oldsize, fuse_malloc_tag);
+    }
+}
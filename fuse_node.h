@@ -22,6 +22,7 @@ enum {
 };
 
 #define FN_DIRECT_IO         0x00000004
+#define FN_MTIME_DIRTY       0x00000008 // modify_time set by a cached write
 
 #define C_NEED_RVNODE_PUT    0x000000001
 #define C_NEED_DVNODE_PUT    0x000000002
@@ -42,6 +43,45 @@ enum {
 #define C_TOUCH_MODTIME      0x000040000
 #define C_XTIMES_VALID       0x000080000
 
+enum {
+    FN_PREFETCH_NONE    = 0,
+    FN_PREFETCH_PENDING = 1, // GETATTR sent ahead, no answer yet
+    FN_PREFETCH_DONE    = 2, // answer parked in prefetch_attr
+};
+
+/*
+ * Raw FUSE_READDIR answer cached for a directory, keyed by the offset it
+ * was read at. An empty page marks the end of the directory.
+ */
+struct fuse_dirpage {
+    struct fuse_dirpage *next;
+    off_t                offset;
+    size_t               size;
+    char                 buf[];
+};
+
+/*
+ * FUSE_ACCESS answer for one credential. The credential is referenced, so
+ * comparing pointers compares uid and the whole group set.
+ */
+struct fuse_access_entry {
+    kauth_cred_t    cred;
+    uint32_t        mask;
+    int             err;
+    uint32_t        epoch;   // attr_epoch when the answer came in
+    struct timespec expires; // attr_valid when the answer came in
+};
+
+/* One cached extended attribute: name, then NUL, then the value. */
+struct fuse_xattr {
+    struct fuse_xattr *next;
+    struct timespec    expires;
+    uint32_t           epoch;   // attr_epoch when the value was asked for
+    size_t             namelen;
+    size_t             size;
+    char               data[];
+};
+
 struct fuse_vnode_data {
 
     /** self **/
@@ -71,6 +111,40 @@ struct fuse_vnode_data {
     uint64_t          nlookup;
     enum vtype        vtype;
 
+    /** attribute prefetch, protected by the mount's node_mtx **/
+    int               prefetch_state;
+    struct timespec   prefetch_valid;
+    struct fuse_attr  prefetch_attr;
+    uint32_t          prefetch_epoch;     // attr_epoch the parked answer belongs to
+    uint64_t          prefetch_lastchild; // directories only
+    uint32_t          prefetch_streak;    // directories only
+    struct timespec   prefetch_time;      // directories only
+
+    /** access decisions, protected by the mount's node_mtx **/
+    struct fuse_access_entry access_cache[FUSE_ACCESS_CACHE_SIZE];
+    uint32_t          access_next;
+    uint32_t          attr_epoch; // bumped by fuse_invalidate_attr, stales access and xattr answers
+
+    /** xattr cache, protected by the mount's node_mtx **/
+    struct fuse_xattr *xattrs;
+    char              *xattr_names;         // listxattr snapshot
+    size_t             xattr_names_size;
+    bool               xattr_names_valid;
+    struct timespec    xattr_names_expires;
+    uint32_t           xattr_names_epoch;
+
+    /** symlink target (symlinks only), protected by the mount's node_mtx **/
+    char              *link_target;
+    size_t             link_target_size;
+    struct timespec    link_target_expires;
+
+    /** readdir cache (directories only), protected by the nodelock **/
+    struct fuse_dirpage *dirpages;
+    size_t               dirpages_size;
+    struct timespec      dirpages_mtime;
+    uint32_t             dirpages_gen;  // bumped without the nodelock by notifications
+    uint32_t             dirpages_seen; // dirpages_gen the cached pages belong to
+
 #ifdef FUSE4X_ENABLE_TSLOCKING
     /*
      * The nodelock must be held when data in the FUSE node is accessed or
@@ -91,6 +165,20 @@ typedef struct fuse_vnode_data * fusenode_t;
 
 void fuse_vnode_data_destroy(struct fuse_vnode_data *fvdat);
 
+void fuse_dircache_purge(vnode_t vp);
+void fuse_dircache_invalidate(vnode_t vp);
+bool fuse_dircache_lookup(vnode_t vp, off_t offset, void **bufp, size_t *sizep);
+void fuse_dircache_store(vnode_t vp, off_t offset, void *buf, size_t size);
+
+void fuse_xattrcache_purge(vnode_t vp);
+bool fuse_xattrcache_lookup(vnode_t vp, const char *name, void **bufp,
+                            size_t *sizep, int *errp);
+void fuse_xattrcache_store(vnode_t vp, const char *name, const void *value,
+                           size_t size, uint32_t epoch);
+bool fuse_xattrcache_list(vnode_t vp, void **bufp, size_t *sizep);
+void fuse_xattrcache_store_list(vnode_t vp, const void *names, size_t size,
+                                uint32_t epoch);
+
 struct fuse_data_nodes;
 RB_PROTOTYPE(fuse_data_nodes, fuse_vnode_data, nodes_link, x);
 
@@ -102,6 +190,15 @@ RB_PROTOTYPE(fuse_data_nodes, fuse_vnode_data, nodes_link, x);
 
 #define FUSE_NULL_ID 0
 
+static __inline__
+void
+fuse_invalidate_access(vnode_t vp)
+{
+    if (VTOFUD(vp)) {
+        OSIncrementAtomic((SInt32 *)&VTOFUD(vp)->attr_epoch);
+    }
+}
+
 static __inline__
 void
 fuse_invalidate_attr(vnode_t vp)
@@ -109,6 +206,13 @@ fuse_invalidate_attr(vnode_t vp)
     if (VTOFUD(vp)) {
         bzero(&VTOFUD(vp)->attr_valid, sizeof(struct timespec));
         VTOFUD(vp)->c_flag &= ~C_XTIMES_VALID;
+        fuse_invalidate_access(vp);
+        /*
+         * A parked prefetch answer predates the change. One that is still
+         * on its way is caught by the epoch bump above.
+         */
+        OSCompareAndSwap(FN_PREFETCH_DONE, FN_PREFETCH_NONE,
+                         (volatile UInt32 *)&VTOFUD(vp)->prefetch_state);
     }
 }
 
@@ -16,10 +16,23 @@
 
 /* NB: none of these are bigger than unsigned 32-bit. */
 
+uint32_t fuse_access_cache_hits      = 0;                                  // r
+uint32_t fuse_access_cache_misses    = 0;                                  // r
 int32_t  fuse_admin_group            = 0;                                  // rw
+uint32_t fuse_admission_waits        = 0;                                  // r
+uint32_t fuse_admission_waits_bulk   = 0;                                  // r
 int32_t  fuse_allow_other            = 0;                                  // rw
 uint32_t fuse_api_major              = FUSE_KERNEL_VERSION;                // r
 uint32_t fuse_api_minor              = FUSE_KERNEL_MINOR_VERSION;          // r
+uint32_t fuse_attr_prefetch_hits     = 0;                                  // r
+uint32_t fuse_attr_prefetch_trigger  = FUSE_DEFAULT_ATTR_PREFETCH_TRIGGER; // rw
+uint32_t fuse_attr_prefetch_wasted   = 0;                                  // r
+uint32_t fuse_attr_prefetch_window   = FUSE_DEFAULT_ATTR_PREFETCH_WINDOW;  // rw
+uint32_t fuse_dircache_hits          = 0;                                  // r
+uint32_t fuse_dircache_maxsize       = FUSE_DEFAULT_DIRCACHE_MAXSIZE;      // rw
+uint32_t fuse_dircache_misses        = 0;                                  // r
+uint32_t fuse_fair_quantum           = FUSE_DEFAULT_FAIR_QUANTUM;          // rw
+uint32_t fuse_fair_queueing          = 1;                                  // rw
 int32_t  fuse_fh_current             = 0;                                  // r
 uint32_t fuse_fh_reuse_count         = 0;                                  // r
 uint32_t fuse_fh_upcall_count        = 0;                                  // r
@@ -28,6 +41,7 @@ int32_t  fuse_iov_credit             = FUSE_DEFAULT_IOV_CREDIT;            // rw
 int32_t  fuse_iov_current            = 0;                                  // r
 uint32_t fuse_iov_permanent_bufsize  = FUSE_DEFAULT_IOV_PERMANENT_BUFSIZE; // rw
 int32_t  fuse_kill                   = -1;                                 // w
+uint32_t fuse_max_bulk_tickets       = 0;                                  // rw
 int32_t  fuse_print_vnodes           = -1;                                 // w
 uint32_t fuse_lookup_cache_hits      = 0;                                  // r
 uint32_t fuse_lookup_cache_misses    = 0;                                  // r
@@ -36,9 +50,18 @@ uint32_t fuse_max_freetickets        = FUSE_DEFAULT_MAX_FREE_TICKETS;      // rw
 uint32_t fuse_max_tickets            = 0;                                  // rw
 int32_t  fuse_mount_count            = 0;                                  // r
 int32_t  fuse_realloc_count          = 0;                                  // r
+uint32_t fuse_spin_wait_hits         = 0;                                  // r
+uint32_t fuse_spin_wait_max          = FUSE_DEFAULT_SPIN_WAIT_MAX;         // rw
+uint32_t fuse_spin_wait_misses       = 0;                                  // r
+uint32_t fuse_statfs_cache_hits      = 0;                                  // r
+uint32_t fuse_statfs_ttl             = FUSE_DEFAULT_STATFS_TTL;            // rw
 int32_t  fuse_tickets_current        = 0;                                  // r
+uint32_t fuse_upcalls_coalesced      = 0;                                  // r
 uint32_t fuse_userkernel_bufsize     = FUSE_DEFAULT_USERKERNEL_BUFSIZE;    // rw
 int32_t  fuse_vnodes_current         = 0;                                  // r
+uint32_t fuse_xattrcache_hits        = 0;                                  // r
+uint32_t fuse_xattrcache_maxsize     = FUSE_DEFAULT_XATTRCACHE_MAXSIZE;    // rw
+uint32_t fuse_xattrcache_misses      = 0;                                  // r
 #ifdef FUSE4X_ENABLE_MACFUSE_MODE
 int32_t  fuse_macfuse_mode           = 0;                                  // w
 #endif
@@ -311,6 +334,22 @@ SYSCTL_PROC(_vfs_generic_fuse4x_control,   // our parent
             "fuse4x Controls: Print Vnodes for the Given File System");
 
 /* fuse.counters */
+SYSCTL_INT(_vfs_generic_fuse4x_counters, OID_AUTO, access_cache_hits, CTLFLAG_RD,
+           &fuse_access_cache_hits, 0, "");
+SYSCTL_INT(_vfs_generic_fuse4x_counters, OID_AUTO, access_cache_misses, CTLFLAG_RD,
+           &fuse_access_cache_misses, 0, "");
+SYSCTL_INT(_vfs_generic_fuse4x_counters, OID_AUTO, admission_waits, CTLFLAG_RD,
+           &fuse_admission_waits, 0, "");
+SYSCTL_INT(_vfs_generic_fuse4x_counters, OID_AUTO, admission_waits_bulk, CTLFLAG_RD,
+           &fuse_admission_waits_bulk, 0, "");
+SYSCTL_INT(_vfs_generic_fuse4x_counters, OID_AUTO, attr_prefetch_hits, CTLFLAG_RD,
+           &fuse_attr_prefetch_hits, 0, "");
+SYSCTL_INT(_vfs_generic_fuse4x_counters, OID_AUTO, attr_prefetch_wasted, CTLFLAG_RD,
+           &fuse_attr_prefetch_wasted, 0, "");
+SYSCTL_INT(_vfs_generic_fuse4x_counters, OID_AUTO, dircache_hits, CTLFLAG_RD,
+           &fuse_dircache_hits, 0, "");
+SYSCTL_INT(_vfs_generic_fuse4x_counters, OID_AUTO, dircache_misses, CTLFLAG_RD,
+           &fuse_dircache_misses, 0, "");
 SYSCTL_INT(_vfs_generic_fuse4x_counters, OID_AUTO, filehandle_reuse, CTLFLAG_RD,
            &fuse_fh_reuse_count, 0, "");
 SYSCTL_INT(_vfs_generic_fuse4x_counters, OID_AUTO, filehandle_upcalls, CTLFLAG_RD,
@@ -323,6 +362,18 @@ SYSCTL_INT(_vfs_generic_fuse4x_counters, OID_AUTO, lookup_cache_overrides,
            CTLFLAG_RD, &fuse_lookup_cache_overrides, 0, "");
 SYSCTL_INT(_vfs_generic_fuse4x_counters, OID_AUTO, memory_reallocs, CTLFLAG_RD,
            &fuse_realloc_count, 0, "");
+SYSCTL_INT(_vfs_generic_fuse4x_counters, OID_AUTO, spin_wait_hits, CTLFLAG_RD,
+           &fuse_spin_wait_hits, 0, "");
+SYSCTL_INT(_vfs_generic_fuse4x_counters, OID_AUTO, spin_wait_misses, CTLFLAG_RD,
+           &fuse_spin_wait_misses, 0, "");
+SYSCTL_INT(_vfs_generic_fuse4x_counters, OID_AUTO, statfs_cache_hits, CTLFLAG_RD,
+           &fuse_statfs_cache_hits, 0, "");
+SYSCTL_INT(_vfs_generic_fuse4x_counters, OID_AUTO, upcalls_coalesced, CTLFLAG_RD,
+           &fuse_upcalls_coalesced, 0, "");
+SYSCTL_INT(_vfs_generic_fuse4x_counters, OID_AUTO, xattrcache_hits, CTLFLAG_RD,
+           &fuse_xattrcache_hits, 0, "");
+SYSCTL_INT(_vfs_generic_fuse4x_counters, OID_AUTO, xattrcache_misses, CTLFLAG_RD,
+           &fuse_xattrcache_misses, 0, "");
 
 /* fuse.resourceusage */
 SYSCTL_INT(_vfs_generic_fuse4x_resourceusage, OID_AUTO, filehandles, CTLFLAG_RD,
@@ -347,14 +398,30 @@ SYSCTL_INT(_vfs_generic_fuse4x_tunables, OID_AUTO, admin_group, CTLFLAG_RW,
            &fuse_admin_group, 0, "");
 SYSCTL_INT(_vfs_generic_fuse4x_tunables, OID_AUTO, allow_other, CTLFLAG_RW,
            &fuse_allow_other, 0, "");
+SYSCTL_INT(_vfs_generic_fuse4x_tunables, OID_AUTO, attr_prefetch_trigger, CTLFLAG_RW,
+           &fuse_attr_prefetch_trigger, 0, "");
+SYSCTL_INT(_vfs_generic_fuse4x_tunables, OID_AUTO, attr_prefetch_window, CTLFLAG_RW,
+           &fuse_attr_prefetch_window, 0, "");
+SYSCTL_INT(_vfs_generic_fuse4x_tunables, OID_AUTO, dircache_maxsize, CTLFLAG_RW,
+           &fuse_dircache_maxsize, 0, "");
+SYSCTL_INT(_vfs_generic_fuse4x_tunables, OID_AUTO, fair_quantum, CTLFLAG_RW,
+           &fuse_fair_quantum, 0, "");
+SYSCTL_INT(_vfs_generic_fuse4x_tunables, OID_AUTO, fair_queueing, CTLFLAG_RW,
+           &fuse_fair_queueing, 0, "");
 SYSCTL_INT(_vfs_generic_fuse4x_tunables, OID_AUTO, iov_credit, CTLFLAG_RW,
            &fuse_iov_credit, 0, "");
 SYSCTL_INT(_vfs_generic_fuse4x_tunables, OID_AUTO, iov_permanent_bufsize, CTLFLAG_RW,
            &fuse_iov_permanent_bufsize, 0, "");
+SYSCTL_INT(_vfs_generic_fuse4x_tunables, OID_AUTO, max_bulk_tickets, CTLFLAG_RW,
+           &fuse_max_bulk_tickets, 0, "");
 SYSCTL_INT(_vfs_generic_fuse4x_tunables, OID_AUTO, max_freetickets, CTLFLAG_RW,
            &fuse_max_freetickets, 0, "");
 SYSCTL_INT(_vfs_generic_fuse4x_tunables, OID_AUTO, max_tickets, CTLFLAG_RW,
            &fuse_max_tickets, 0, "");
+SYSCTL_INT(_vfs_generic_fuse4x_tunables, OID_AUTO, spin_wait_max, CTLFLAG_RW,
+           &fuse_spin_wait_max, 0, "");
+SYSCTL_INT(_vfs_generic_fuse4x_tunables, OID_AUTO, statfs_ttl, CTLFLAG_RW,
+           &fuse_statfs_ttl, 0, "");
 SYSCTL_PROC(_vfs_generic_fuse4x_tunables,          // our parent
             OID_AUTO,                   // automatically assign object ID
             userkernel_bufsize,         // our name
@@ -364,6 +431,8 @@ SYSCTL_PROC(_vfs_generic_fuse4x_tunables,          // our parent
             sysctl_fuse4x_tunables_userkernel_bufsize_handler,
             "I",                        // our data type (integer)
             "fuse4x Tunables");        // our description
+SYSCTL_INT(_vfs_generic_fuse4x_tunables, OID_AUTO, xattrcache_maxsize, CTLFLAG_RW,
+           &fuse_xattrcache_maxsize, 0, "");
 
 /* fuse.version */
 SYSCTL_INT(_vfs_generic_fuse4x_version, OID_AUTO, api_major, CTLFLAG_RD,
@@ -387,12 +456,26 @@ static struct sysctl_oid *fuse_sysctl_list[] =
     &sysctl__vfs_generic_fuse4x_control_macfuse_mode,
 #endif
     &sysctl__vfs_generic_fuse4x_control_print_vnodes,
+    &sysctl__vfs_generic_fuse4x_counters_access_cache_hits,
+    &sysctl__vfs_generic_fuse4x_counters_access_cache_misses,
+    &sysctl__vfs_generic_fuse4x_counters_admission_waits,
+    &sysctl__vfs_generic_fuse4x_counters_admission_waits_bulk,
+    &sysctl__vfs_generic_fuse4x_counters_attr_prefetch_hits,
+    &sysctl__vfs_generic_fuse4x_counters_attr_prefetch_wasted,
+    &sysctl__vfs_generic_fuse4x_counters_dircache_hits,
+    &sysctl__vfs_generic_fuse4x_counters_dircache_misses,
     &sysctl__vfs_generic_fuse4x_counters_filehandle_reuse,
     &sysctl__vfs_generic_fuse4x_counters_filehandle_upcalls,
     &sysctl__vfs_generic_fuse4x_counters_lookup_cache_hits,
     &sysctl__vfs_generic_fuse4x_counters_lookup_cache_misses,
     &sysctl__vfs_generic_fuse4x_counters_lookup_cache_overrides,
     &sysctl__vfs_generic_fuse4x_counters_memory_reallocs,
+    &sysctl__vfs_generic_fuse4x_counters_spin_wait_hits,
+    &sysctl__vfs_generic_fuse4x_counters_spin_wait_misses,
+    &sysctl__vfs_generic_fuse4x_counters_statfs_cache_hits,
+    &sysctl__vfs_generic_fuse4x_counters_upcalls_coalesced,
+    &sysctl__vfs_generic_fuse4x_counters_xattrcache_hits,
+    &sysctl__vfs_generic_fuse4x_counters_xattrcache_misses,
     &sysctl__vfs_generic_fuse4x_resourceusage_filehandles,
     &sysctl__vfs_generic_fuse4x_resourceusage_filehandles_zombies,
     &sysctl__vfs_generic_fuse4x_resourceusage_ipc_iovs,
@@ -404,11 +487,20 @@ static struct sysctl_oid *fuse_sysctl_list[] =
     &sysctl__vfs_generic_fuse4x_resourceusage_vnodes,
     &sysctl__vfs_generic_fuse4x_tunables_admin_group,
     &sysctl__vfs_generic_fuse4x_tunables_allow_other,
+    &sysctl__vfs_generic_fuse4x_tunables_attr_prefetch_trigger,
+    &sysctl__vfs_generic_fuse4x_tunables_attr_prefetch_window,
+    &sysctl__vfs_generic_fuse4x_tunables_dircache_maxsize,
+    &sysctl__vfs_generic_fuse4x_tunables_fair_quantum,
+    &sysctl__vfs_generic_fuse4x_tunables_fair_queueing,
     &sysctl__vfs_generic_fuse4x_tunables_iov_credit,
     &sysctl__vfs_generic_fuse4x_tunables_iov_permanent_bufsize,
+    &sysctl__vfs_generic_fuse4x_tunables_max_bulk_tickets,
     &sysctl__vfs_generic_fuse4x_tunables_max_freetickets,
     &sysctl__vfs_generic_fuse4x_tunables_max_tickets,
+    &sysctl__vfs_generic_fuse4x_tunables_spin_wait_max,
+    &sysctl__vfs_generic_fuse4x_tunables_statfs_ttl,
     &sysctl__vfs_generic_fuse4x_tunables_userkernel_bufsize,
+    &sysctl__vfs_generic_fuse4x_tunables_xattrcache_maxsize,
     &sysctl__vfs_generic_fuse4x_version_api_major,
     &sysctl__vfs_generic_fuse4x_version_api_minor,
     &sysctl__vfs_generic_fuse4x_version_number,
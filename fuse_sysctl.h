@@ -8,8 +8,21 @@
 
 #include "fuse.h"
 
+extern uint32_t fuse_access_cache_hits;
+extern uint32_t fuse_access_cache_misses;
 extern int32_t  fuse_admin_group;
+extern uint32_t fuse_admission_waits;
+extern uint32_t fuse_admission_waits_bulk;
 extern int32_t  fuse_allow_other;
+extern uint32_t fuse_attr_prefetch_hits;
+extern uint32_t fuse_attr_prefetch_trigger;
+extern uint32_t fuse_attr_prefetch_wasted;
+extern uint32_t fuse_attr_prefetch_window;
+extern uint32_t fuse_dircache_hits;
+extern uint32_t fuse_dircache_maxsize;
+extern uint32_t fuse_dircache_misses;
+extern uint32_t fuse_fair_quantum;
+extern uint32_t fuse_fair_queueing;
 extern int32_t  fuse_fh_current;
 extern uint32_t fuse_fh_reuse_count;
 extern uint32_t fuse_fh_upcall_count;
@@ -20,13 +33,23 @@ extern uint32_t fuse_iov_permanent_bufsize;
 extern uint32_t fuse_lookup_cache_hits;
 extern uint32_t fuse_lookup_cache_misses;
 extern uint32_t fuse_lookup_cache_overrides;
+extern uint32_t fuse_max_bulk_tickets;
 extern uint32_t fuse_max_tickets;
 extern uint32_t fuse_max_freetickets;
 extern int32_t  fuse_mount_count;
 extern int32_t  fuse_realloc_count;
+extern uint32_t fuse_spin_wait_hits;
+extern uint32_t fuse_spin_wait_max;
+extern uint32_t fuse_spin_wait_misses;
+extern uint32_t fuse_statfs_cache_hits;
+extern uint32_t fuse_statfs_ttl;
 extern int32_t  fuse_tickets_current;
+extern uint32_t fuse_upcalls_coalesced;
 extern uint32_t fuse_userkernel_bufsize;
 extern int32_t  fuse_vnodes_current;
+extern uint32_t fuse_xattrcache_hits;
+extern uint32_t fuse_xattrcache_maxsize;
+extern uint32_t fuse_xattrcache_misses;
 
 #ifdef FUSE4X_COUNT_MEMORY
 extern int32_t  fuse_memory_allocated;
@@ -175,7 +175,11 @@ fuse_vfsop_mount(mount_t mp, __unused vnode_t devvp, user_addr_t udata,
 
     err = ENOTSUP;
 
-    vfs_setlocklocal(mp);
+    /*
+     * Advisory locks are kept locally only with locallocks or when the
+     * daemon turns FUSE_POSIX_LOCKS down; fuse_internal_init_callback()
+     * decides the latter.
+     */
 
     /** Option Processing. **/
 
@@ -204,6 +208,22 @@ fuse_vfsop_mount(mount_t mp, __unused vnode_t devvp, user_addr_t udata,
         mntopts |= FSESS_AUTO_CACHE;
     }
 
+    if (fusefs_args.altflags & FUSE_MOPT_SPIN_WAIT) {
+        mntopts |= FSESS_SPIN_WAIT;
+    }
+
+    if (fusefs_args.altflags & FUSE_MOPT_LOCAL_LOCKS) {
+        mntopts |= FSESS_LOCAL_LOCKS;
+        vfs_setlocklocal(mp);
+    }
+
+    if (fusefs_args.altflags & FUSE_MOPT_WRITEBACK_CACHE) {
+        if (fusefs_args.altflags & (FUSE_MOPT_DIRECT_IO | FUSE_MOPT_NO_READAHEAD)) {
+            return EINVAL;
+        }
+        mntopts |= FSESS_WRITEBACK_OPT;
+    }
+
     if (fusefs_args.altflags & FUSE_MOPT_AUTO_XATTR) {
         if (fusefs_args.altflags & FUSE_MOPT_NATIVE_XATTR) {
             return EINVAL;
@@ -366,6 +386,12 @@ fuse_vfsop_mount(mount_t mp, __unused vnode_t devvp, user_addr_t udata,
         return ENXIO;
     }
 
+    if (fdev->channel != 0) {
+        /* A mount is set up on the device the daemon opened first. */
+        fuse_lck_mtx_unlock(fdev->mtx);
+        return EINVAL;
+    }
+
 #ifdef FUSE4X_ENABLE_BIGLOCK
     biglock = data->biglock;
     fuse_biglock_lock(biglock);
@@ -967,7 +993,10 @@ fuse_vfsop_getattr(mount_t mp, struct vfs_attr *attr, vfs_context_t context)
     struct fuse_dispatcher  fdi;
     struct fuse_statfs_out *fsfo;
     struct fuse_statfs_out  faked;
+    struct fuse_statfs_out  cached;
     struct fuse_data       *data;
+    struct timespec         uptsp;
+    bool fromcache = false;
 
     fuse_trace_printf_vfsop();
 
@@ -984,6 +1013,21 @@ fuse_vfsop_getattr(mount_t mp, struct vfs_attr *attr, vfs_context_t context)
         goto dostatfs;
     }
 
+    /* Volume attributes are polled constantly, so reuse recent answers. */
+    nanouptime(&uptsp);
+
+    fuse_lck_mtx_lock(data->node_mtx);
+    if (fuse_timespec_cmp(&uptsp, &data->statfs_expires, <)) {
+        cached = data->statfs_cache;
+        fromcache = true;
+    }
+    fuse_lck_mtx_unlock(data->node_mtx);
+
+    if (fromcache) {
+        OSIncrementAtomic((SInt32 *)&fuse_statfs_cache_hits);
+        goto dostatfs;
+    }
+
     fuse_dispatcher_init(&fdi, 0);
     fuse_dispatcher_make(&fdi, FUSE_STATFS, mp, FUSE_ROOT_ID, context);
     if ((err = fuse_dispatcher_wait_answer(&fdi))) {
@@ -999,10 +1043,28 @@ fuse_vfsop_getattr(mount_t mp, struct vfs_attr *attr, vfs_context_t context)
         return err;
     }
 
+    if (fdi.iosize >= sizeof(struct fuse_statfs_out)) {
+        uint32_t ttl = ((struct fuse_statfs_out *)fdi.answer)->st.valid;
+
+        if (ttl == 0) {
+            ttl = fuse_statfs_ttl;
+        }
+
+        if (ttl) {
+            fuse_lck_mtx_lock(data->node_mtx);
+            data->statfs_cache = *(struct fuse_statfs_out *)fdi.answer;
+            data->statfs_expires = uptsp;
+            data->statfs_expires.tv_sec += ttl;
+            fuse_lck_mtx_unlock(data->node_mtx);
+        }
+    }
+
 dostatfs:
     if (faking) {
         bzero(&faked, sizeof(faked));
         fsfo = &faked;
+    } else if (fromcache) {
+        fsfo = &cached;
     } else {
         fsfo = fdi.answer;
     }
@@ -1115,7 +1177,7 @@ dostatfs:
     VFSATTR_RETURN(attr, f_signature, OSSwapBigToHostInt16(FUSEFS_SIGNATURE));
     VFSATTR_RETURN(attr, f_carbon_fsid, 0);
 
-    if (!faking)
+    if (!faking && !fromcache)
         fuse_ticket_drop(fdi.ticket);
 
     return 0;
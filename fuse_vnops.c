@@ -29,6 +29,7 @@
 #include <sys/errno.h>
 #include <sys/fcntl.h>
 #include <sys/kernel_types.h>
+#include <sys/lockf.h>
 #include <sys/mount.h>
 #include <sys/param.h>
 #include <sys/proc.h>
@@ -103,6 +104,259 @@ fuse_vnop_access(struct vnop_access_args *ap)
     return fuse_internal_access(vp, action, context);
 }
 
+/*
+    struct vnop_advlock_args {
+        struct vnodeop_desc *a_desc;
+        vnode_t              a_vp;
+        caddr_t              a_id;
+        int                  a_op;
+        struct flock        *a_fl;
+        int                  a_flags;
+        vfs_context_t        a_context;
+    };
+*/
+FUSE_VNOP_EXPORT
+int
+fuse_vnop_advlock(struct vnop_advlock_args *ap)
+{
+    vnode_t       vp      = ap->a_vp;
+    struct flock *fl      = ap->a_fl;
+    vfs_context_t context = ap->a_context;
+
+    struct fuse_dispatcher  fdi;
+    struct fuse_lk_in      *fli;
+    struct fuse_lk_out     *flo;
+    struct fuse_data       *data;
+    struct fuse_vnode_data *fvdat = VTOFUD(vp);
+    uint64_t fh = 0;
+    uint64_t owner;
+    off_t start;
+    off_t end;
+    int type;
+    int op;
+    int err;
+
+    fuse_trace_printf_vnop();
+
+    if (fuse_isdeadfs(vp)) {
+        return ENXIO;
+    }
+
+    /*
+     * Mounts that keep their locks locally have VLOCKLOCAL set on every
+     * vnode and never get here: the VFS runs lf_advlock() for them.
+     */
+    data = fuse_get_mpdata(vnode_mount(vp));
+
+    /*
+     * A daemon that did not ask for FUSE_FLOCK_LOCKS cannot tell flock(2)
+     * locks from fcntl(2) ones, so, as on Linux, they are kept here.
+     */
+    if ((ap->a_flags & F_FLOCK) && !(data->dataflags & FSESS_FLOCK_LOCKS)) {
+        return lf_advlock(ap);
+    }
+
+    if (!(data->dataflags & FSESS_POSIX_LOCKS) ||
+        !fuse_implemented(data, FSESS_NOIMPLBIT(SETLK))) {
+        return ENOTSUP;
+    }
+
+    switch (ap->a_op) {
+    case F_GETLK:
+        op = FUSE_GETLK;
+        type = fl->l_type;
+        break;
+    case F_SETLK:
+        op = (ap->a_flags & F_WAIT) ? FUSE_SETLKW : FUSE_SETLK;
+        type = fl->l_type;
+        break;
+    case F_UNLCK:
+        op = FUSE_SETLK;
+        type = F_UNLCK;
+        break;
+    default:
+        return EINVAL;
+    }
+
+    switch (fl->l_whence) {
+    case SEEK_SET:
+    case SEEK_CUR: /* fcntl() has added the file offset already */
+        start = fl->l_start;
+        break;
+    case SEEK_END:
+        start = fvdat->filesize + fl->l_start;
+        break;
+    default:
+        return EINVAL;
+    }
+
+    if (fl->l_len < 0) {
+        end = start - 1;
+        start += fl->l_len;
+    } else if (fl->l_len == 0) {
+        end = INT64_MAX;
+    } else if (start > INT64_MAX - fl->l_len + 1) {
+        return EOVERFLOW;
+    } else {
+        end = start + fl->l_len - 1;
+    }
+    if (start < 0) {
+        return EINVAL;
+    }
+
+    for (int i = 0; i < FUFH_MAXTYPE; i++) {
+        if (FUFH_IS_VALID(&fvdat->fufh[i])) {
+            fh = fvdat->fufh[i].fh_id;
+            break;
+        }
+    }
+
+    if (ap->a_flags & F_FLOCK) {
+        /*
+         * flock(2) locks belong to the open file. Scramble its address and
+         * set the top bit so the owner never looks like a pid.
+         */
+        owner = ((uint64_t)(uintptr_t)ap->a_id * 0x9E3779B97F4A7C15ULL) | (1ULL << 63);
+    } else {
+        owner = (uint64_t)proc_pid((proc_t)ap->a_id);
+    }
+
+    fuse_dispatcher_init(&fdi, sizeof(*fli));
+    fuse_dispatcher_make_vp(&fdi, op, vp, context);
+
+    fli = fdi.indata;
+    fli->fh       = fh;
+    fli->owner    = owner;
+    fli->lk.start = (uint64_t)start;
+    fli->lk.end   = (uint64_t)end;
+    fli->lk.type  = type;
+    fli->lk.pid   = (uint32_t)proc_pid(vfs_context_proc(context));
+    fli->lk_flags = (ap->a_flags & F_FLOCK) ? FUSE_LK_FLOCK : 0;
+
+    err = fuse_dispatcher_wait_answer(&fdi);
+
+    if (!err) {
+        if (op == FUSE_GETLK) {
+            flo = fdi.answer;
+            fl->l_type = flo->lk.type;
+            if (flo->lk.type != F_UNLCK) {
+                fl->l_whence = SEEK_SET;
+                fl->l_start  = (off_t)flo->lk.start;
+                fl->l_len    = (flo->lk.end >= INT64_MAX) ? 0 :
+                               (off_t)(flo->lk.end - flo->lk.start + 1);
+                fl->l_pid    = flo->lk.pid;
+            }
+        }
+        fuse_ticket_drop(fdi.ticket);
+    } else if (err == ENOSYS) {
+        /* Missing flock(2) support says nothing about fcntl(2) locks. */
+        if (!(ap->a_flags & F_FLOCK)) {
+            fuse_clear_implemented(data, FSESS_NOIMPLBIT(SETLK));
+        }
+        err = ENOTSUP;
+    }
+
+    return err;
+}
+
+/*
+    struct vnop_allocate_args {
+        struct vnodeop_desc *a_desc;
+        vnode_t              a_vp;
+        off_t                a_length;
+        u_int32_t            a_flags;
+        off_t               *a_bytesallocated;
+        off_t                a_offset;
+        vfs_context_t        a_context;
+    };
+*/
+FUSE_VNOP_EXPORT
+int
+fuse_vnop_allocate(struct vnop_allocate_args *ap)
+{
+    vnode_t       vp      = ap->a_vp;
+    off_t         length  = ap->a_length;
+    vfs_context_t context = ap->a_context;
+
+    int err;
+    fufh_type_t fufh_type;
+    struct fuse_dispatcher    fdi;
+    struct fuse_fallocate_in *ffi;
+    struct fuse_filehandle   *fufh;
+    struct fuse_vnode_data   *fvdat = VTOFUD(vp);
+    struct fuse_data         *data  = fuse_get_mpdata(vnode_mount(vp));
+
+    fuse_trace_printf_vnop();
+
+    *(ap->a_bytesallocated) = 0;
+
+    if (fuse_isdeadfs(vp)) {
+        return ENXIO;
+    }
+
+    if (!vnode_isreg(vp)) {
+        return vnode_isdir(vp) ? EISDIR : EINVAL;
+    }
+
+    if (length < 0) {
+        return EINVAL;
+    }
+
+    if (length == 0) {
+        return 0;
+    }
+
+    if (!fuse_implemented(data, FSESS_NOIMPLBIT(FALLOCATE))) {
+        return ENOTSUP;
+    }
+
+    fufh_type = FUFH_WRONLY;
+    fufh = &(fvdat->fufh[fufh_type]);
+    if (!FUFH_IS_VALID(fufh)) {
+        fufh_type = FUFH_RDWR;
+        fufh = &(fvdat->fufh[fufh_type]);
+        if (!FUFH_IS_VALID(fufh)) {
+            return EBADF;
+        }
+    }
+
+    fuse_dispatcher_init(&fdi, sizeof(*ffi));
+    fuse_dispatcher_make_vp(&fdi, FUSE_FALLOCATE, vp, context);
+    ffi = fdi.indata;
+    ffi->fh = fufh->fh_id;
+
+    /*
+     * As in HFS, ALLOCATEFROMPEOF asks for length more bytes past the end
+     * of the file, and otherwise length is what the whole file should
+     * have. We cannot see where the daemon's storage ends, so the logical
+     * EOF stands in for the physical one. F_PREALLOCATE never changes the
+     * size of the file, a later ftruncate() does that, so neither filesize
+     * nor the UBC size is touched here.
+     */
+    if (ap->a_flags & ALLOCATEFROMPEOF) {
+        ffi->offset = fvdat->filesize + ap->a_offset;
+        ffi->length = length;
+    } else {
+        ffi->offset = 0;
+        ffi->length = length;
+        length = (length > fvdat->filesize) ? length - fvdat->filesize : 0;
+    }
+    ffi->mode = FUSE_FALLOC_FL_KEEP_SIZE;
+
+    err = fuse_dispatcher_wait_answer(&fdi);
+    if (!err) {
+        fuse_ticket_drop(fdi.ticket);
+        *(ap->a_bytesallocated) = length;
+        /* Block counts have changed. */
+        fuse_invalidate_attr(vp);
+    } else if (err == ENOSYS) {
+        fuse_clear_implemented(data, FSESS_NOIMPLBIT(FALLOCATE));
+        err = ENOTSUP;
+    }
+
+    return err;
+}
+
 /*
     struct vnop_blktooff_args {
         struct vnodeop_desc *a_desc;
@@ -276,8 +530,27 @@ fuse_vnop_close(struct vnop_close_args *ap)
      * writing before we close this precious writable descriptor, we might
      * be doomed.
      */
-    if (vnode_hasdirtyblks(vp) && !fuse_isnosynconclose(vp)) {
-        (void)cluster_push(vp, IO_SYNC | IO_CLOSE);
+    if (fuse_iswritebackcache(vp) && fufh->open_count > 1) {
+        /*
+         * The handle stays open, so the pages can go out later. Their
+         * WRITEs would reach the daemon after a SETATTR(mtime) sent now and
+         * move mtime again, so that waits for the last close or fsync.
+         */
+        if (vnode_hasdirtyblks(vp) && !fuse_isnosynconclose(vp)) {
+            (void)cluster_push(vp, IO_CLOSE);
+        }
+    } else {
+        if (vnode_hasdirtyblks(vp) && !fuse_isnosynconclose(vp)) {
+            (void)cluster_push(vp, IO_SYNC | IO_CLOSE);
+        }
+
+        if (!vnode_hasdirtyblks(vp)) {
+            if (fuse_iswritebackcache(vp)) {
+                /* Earlier closes may have left writes in flight. */
+                (void)vnode_waitforwrites(vp, 0, 0, 0, "fuse4x_close");
+            }
+            (void)fuse_internal_attr_flush_mtime(vp, context);
+        }
     }
 
     data = fuse_get_mpdata(vnode_mount(vp));
@@ -437,8 +710,7 @@ bringup:
            fri = dispatcher->indata;
            fri->fh = fh_id;
            fri->flags = OFLAGS(mode);
-           fuse_insert_callback(dispatcher->ticket, fuse_internal_forget_callback);
-           fuse_insert_message(dispatcher->ticket);
+           fuse_insert_request(dispatcher->ticket, fuse_internal_forget_callback);
        }
        return err;
     }
@@ -464,6 +736,7 @@ bringup:
     }
 
     cache_purge_negatives(dvp);
+    fuse_dircache_purge(dvp);
 
     fuse_ticket_drop(dispatcher->ticket);
 
@@ -621,7 +894,14 @@ fuse_vnop_fsync(struct vnop_fsync_args *ap)
         return 0;
     }
 
-    cluster_push(vp, 0);
+    if (fuse_iswritebackcache(vp)) {
+        /* The daemon cannot sync what it has not been sent yet. */
+        cluster_push(vp, IO_SYNC);
+        (void)vnode_waitforwrites(vp, 0, 0, 0, "fuse4x_fsync");
+        (void)fuse_internal_attr_flush_mtime(vp, context);
+    } else {
+        cluster_push(vp, 0);
+    }
 
     /*
      * struct timeval tv;
@@ -724,31 +1004,79 @@ fuse_vnop_getattr(struct vnop_getattr_args *ap)
         }
     }
 
-    fuse_dispatcher_init(&fdi, sizeof(struct fuse_getattr_in));
-    fuse_dispatcher_make_vp(&fdi, FUSE_GETATTR, vp, context);
-    bzero(fdi.indata, sizeof(struct fuse_getattr_in));
+    struct fuse_attr_out  prefetched;
+    struct fuse_attr_out *attr_out;
+    struct fuse_flight   *flight = NULL;
+    bool leader = false;
+    bool from_prefetch = fuse_internal_attr_prefetched(vp, &prefetched);
 
-    if ((err = fuse_dispatcher_wait_answer(&fdi))) {
-        if ((err == ENOTCONN) && vnode_isvroot(vp)) {
-            /* see comment at similar place in fuse_statfs() */
-            goto fake;
+    fuse_internal_attr_prefetch(vp, context);
+
+    if (!from_prefetch) {
+        flight = fuse_internal_flight_join(data, FUSE_GETATTR, VTOI(vp),
+                                           "", 0, context, &leader);
+    }
+
+    if (flight && !leader) {
+        /* Somebody else is asking already, take a copy of the answer. */
+        err = fuse_internal_flight_wait(data, flight);
+        if (!err) {
+            prefetched = flight->answer.attr;
         }
-        if (err == ENOENT) {
+        fuse_internal_flight_put(data, flight);
+        flight = NULL;
+
+        if (!err) {
+            /* Like a prefetched answer, there is no ticket to drop. */
+            from_prefetch = true;
+        } else if (err != EAGAIN) {
+            if ((err == ENOTCONN) && vnode_isvroot(vp)) {
+                goto fake;
+            }
+            return err;
+        }
+    }
+
+    if (from_prefetch) {
+        attr_out = &prefetched;
+    } else {
+        fuse_dispatcher_init(&fdi, sizeof(struct fuse_getattr_in));
+        fuse_dispatcher_make_vp(&fdi, FUSE_GETATTR, vp, context);
+        bzero(fdi.indata, sizeof(struct fuse_getattr_in));
+
+        err = fuse_dispatcher_wait_answer(&fdi);
+        if (flight) {
+            if (!err) {
+                flight->answer.attr = *(struct fuse_attr_out *)fdi.answer;
+            }
+            fuse_internal_flight_land(data, flight, err);
+        }
+
+        if (err) {
+            if ((err == ENOTCONN) && vnode_isvroot(vp)) {
+                /* see comment at similar place in fuse_statfs() */
+                goto fake;
+            }
+            if (err == ENOENT) {
 #ifdef FUSE4X_ENABLE_BIGLOCK
-            fuse_biglock_unlock(data->biglock);
+                fuse_biglock_unlock(data->biglock);
 #endif
-            fuse_vncache_purge(vp); 
+                fuse_vncache_purge(vp);
 #ifdef FUSE4X_ENABLE_BIGLOCK
-            fuse_biglock_lock(data->biglock);
+                fuse_biglock_lock(data->biglock);
 #endif
+            }
+            return err;
         }
-        return err;
-    }
 
-    struct fuse_attr_out *attr_out = fdi.answer;
+        attr_out = fdi.answer;
+    }
     /* XXX: Could check the sanity/volatility of va_mode here. */
 
     if ((attr_out->attr.mode & S_IFMT) == 0) {
+        if (!from_prefetch) {
+            fuse_ticket_drop(fdi.ticket);
+        }
         return EIO;
     }
 
@@ -774,7 +1102,9 @@ fuse_vnop_getattr(struct vnop_getattr_args *ap)
         VTOFUD(vp)->filesize = attr_out->attr.size;
     }
 
-    fuse_ticket_drop(fdi.ticket);
+    if (!from_prefetch) {
+        fuse_ticket_drop(fdi.ticket);
+    }
 
     if (vnode_vtype(vp) != vap->va_type) {
         if ((vnode_vtype(vp) == VNON) && (vap->va_type != VNON)) {
@@ -844,6 +1174,9 @@ fuse_vnop_getxattr(struct vnop_getxattr_args *ap)
 
     int err = 0;
     size_t namelen;
+    uint32_t probesize = 0;
+    uint32_t epoch;
+    bool cacheable;
 
     fuse_trace_printf_vnop();
 
@@ -872,8 +1205,45 @@ fuse_vnop_getxattr(struct vnop_getxattr_args *ap)
         return ENOTSUP;
     }
 
+    /* Only whole values are cached; resource fork reads come with offsets. */
+    cacheable = (uio_offset(uio) == 0);
+
+    if (cacheable) {
+        void *buf = NULL;
+        size_t bufsize = 0;
+
+        if (fuse_xattrcache_lookup(vp, name, &buf, &bufsize, &err)) {
+            OSIncrementAtomic((SInt32 *)&fuse_xattrcache_hits);
+            if (!err) {
+                *ap->a_size = bufsize;
+                if (uio) {
+                    if ((user_ssize_t)bufsize > uio_resid(uio)) {
+                        err = ERANGE;
+                    } else {
+                        err = uiomove((char *)buf, (int)bufsize, uio);
+                    }
+                }
+                if (buf) {
+                    FUSE_OSFree(buf, bufsize, fuse_malloc_tag);
+                }
+            }
+            return err;
+        }
+        OSIncrementAtomic((SInt32 *)&fuse_xattrcache_misses);
+
+        /*
+         * A size probe asks for the value itself when a cacheable one
+         * would fit, so the fetch that normally follows needs no upcall.
+         */
+        if (!uio) {
+            probesize = min(fuse_xattrcache_maxsize, FUSE_REASONABLE_XATTRSIZE);
+        }
+    }
+
     namelen = strlen(name);
 
+again:
+    epoch = VTOFUD(vp)->attr_epoch;
     fuse_dispatcher_init(&fdi, sizeof(*fgxi) + namelen + 1);
     fuse_dispatcher_make_vp(&fdi, FUSE_GETXATTR, vp, context);
     fgxi = fdi.indata;
@@ -881,7 +1251,7 @@ fuse_vnop_getxattr(struct vnop_getxattr_args *ap)
     if (uio) {
         fgxi->size = (uint32_t)uio_resid(uio);
     } else {
-        fgxi->size = 0;
+        fgxi->size = probesize;
     }
 
     fgxi->position = (uint32_t)uio_offset(uio);
@@ -895,6 +1265,11 @@ fuse_vnop_getxattr(struct vnop_getxattr_args *ap)
 
     err = fuse_dispatcher_wait_answer(&fdi);
     if (err) {
+        if (err == ERANGE && probesize) {
+            /* Too big to cache, fall back to a plain size probe. */
+            probesize = 0;
+            goto again;
+        }
         if (err == ENOSYS) {
             fuse_clear_implemented(data, FSESS_NOIMPLBIT(GETXATTR));
             return ENOTSUP;
@@ -907,8 +1282,14 @@ fuse_vnop_getxattr(struct vnop_getxattr_args *ap)
         if ((user_ssize_t)fdi.iosize > uio_resid(uio)) {
             err = ERANGE;
         } else {
+            if (cacheable) {
+                fuse_xattrcache_store(vp, name, fdi.answer, fdi.iosize, epoch);
+            }
             err = uiomove((char *)fdi.answer, (int)fdi.iosize, uio);
         }
+    } else if (probesize) {
+        *ap->a_size = fdi.iosize;
+        fuse_xattrcache_store(vp, name, fdi.answer, fdi.iosize, epoch);
     } else {
         fgxo = (struct fuse_getxattr_out *)fdi.answer;
         *ap->a_size = fgxo->size;
@@ -1014,6 +1395,7 @@ fuse_vnop_link(struct vnop_link_args *ap)
     fuse_ticket_drop(fdi.ticket);
     fuse_invalidate_attr(tdvp);
     fuse_invalidate_attr(vp);
+    fuse_dircache_purge(tdvp);
 
     if (err == 0) {
         VTOFUD(vp)->nlookup++;
@@ -1046,6 +1428,10 @@ fuse_vnop_listxattr(struct vnop_listxattr_args *ap)
     struct fuse_data         *data;
 
     int err = 0;
+    uint32_t probesize = 0;
+    uint32_t epoch;
+    void *buf = NULL;
+    size_t bufsize = 0;
 
     fuse_trace_printf_vnop();
 
@@ -1065,17 +1451,45 @@ fuse_vnop_listxattr(struct vnop_listxattr_args *ap)
         return ENOTSUP;
     }
 
+    if (fuse_xattrcache_list(vp, &buf, &bufsize)) {
+        OSIncrementAtomic((SInt32 *)&fuse_xattrcache_hits);
+        *ap->a_size = bufsize;
+        if (uio) {
+            if ((user_ssize_t)bufsize > uio_resid(uio)) {
+                err = ERANGE;
+            } else {
+                err = uiomove((char *)buf, (int)bufsize, uio);
+            }
+        }
+        if (buf) {
+            FUSE_OSFree(buf, bufsize, fuse_malloc_tag);
+        }
+        return err;
+    }
+    OSIncrementAtomic((SInt32 *)&fuse_xattrcache_misses);
+
+    /* As in getxattr, a size probe fetches the list if it can be cached. */
+    if (!uio) {
+        probesize = min(fuse_xattrcache_maxsize, FUSE_REASONABLE_XATTRSIZE);
+    }
+
+again:
+    epoch = VTOFUD(vp)->attr_epoch;
     fuse_dispatcher_init(&fdi, sizeof(*fgxi));
     fuse_dispatcher_make_vp(&fdi, FUSE_LISTXATTR, vp, context);
     fgxi = fdi.indata;
     if (uio) {
         fgxi->size = (uint32_t)uio_resid(uio);
     } else {
-        fgxi->size = 0;
+        fgxi->size = probesize;
     }
 
     err = fuse_dispatcher_wait_answer(&fdi);
     if (err) {
+        if (err == ERANGE && probesize) {
+            probesize = 0;
+            goto again;
+        }
         if (err == ENOSYS) {
             fuse_clear_implemented(data, FSESS_NOIMPLBIT(LISTXATTR));
             return ENOTSUP;
@@ -1088,8 +1502,12 @@ fuse_vnop_listxattr(struct vnop_listxattr_args *ap)
         if ((user_ssize_t)fdi.iosize > uio_resid(uio)) {
             err = ERANGE;
         } else {
+            fuse_xattrcache_store_list(vp, fdi.answer, fdi.iosize, epoch);
             err = uiomove((char *)fdi.answer, (int)fdi.iosize, uio);
         }
+    } else if (probesize) {
+        *ap->a_size = fdi.iosize;
+        fuse_xattrcache_store_list(vp, fdi.answer, fdi.iosize, epoch);
     } else {
         fgxo = (struct fuse_getxattr_out *)fdi.answer;
         *ap->a_size = fgxo->size;
@@ -1134,6 +1552,7 @@ fuse_vnop_lookup(struct vnop_lookup_args *ap)
 
     struct fuse_dispatcher fdi;
     enum   fuse_opcode     op;
+    struct fuse_flight    *flight = NULL;
 
     uint64_t nodeid;
     uint64_t parent_nodeid;
@@ -1211,6 +1630,45 @@ fuse_vnop_lookup(struct vnop_lookup_args *ap)
         }
     }
 
+    if (nameiop == LOOKUP) {
+        struct fuse_data *data = fuse_get_mpdata(mp);
+        bool leader;
+
+        flight = fuse_internal_flight_join(data, FUSE_LOOKUP, VTOI(dvp),
+                                           cnp->cn_nameptr, cnp->cn_namelen,
+                                           context, &leader);
+        if (flight && !leader) {
+            /*
+             * Somebody else is looking up the same name. Take the vnode it
+             * got rather than going through fuse_vget_i(), the daemon has
+             * counted only one lookup.
+             */
+            err = fuse_internal_flight_wait(data, flight);
+            if (!err) {
+                vp = flight->answer.node.vp;
+                if (vnode_getwithvid(vp, flight->answer.node.vid)) {
+                    /* Recycled in the meantime, ask for ourselves. */
+                    err = EAGAIN;
+                } else {
+                    *vpp = vp;
+                }
+            }
+            fuse_internal_flight_put(data, flight);
+            flight = NULL;
+
+            if (!err && !islastcn &&
+                vnode_vtype(*vpp) != VDIR && vnode_vtype(*vpp) != VLNK) {
+                vnode_put(*vpp);
+                *vpp = NULLVP;
+                err = ENOTDIR;
+            }
+            if (err != EAGAIN) {
+                return err;
+            }
+            err = 0;
+        }
+    }
+
     nodeid = VTOI(dvp);
     parent_nodeid = VTOI(dvp);
     fuse_dispatcher_init(&fdi, cnp->cn_namelen + 1);
@@ -1247,7 +1705,8 @@ calldaemon:
 
     if (lookup_err &&
         (!fdi.answer_errno || lookup_err != ENOENT || op != FUSE_LOOKUP)) {
-        return lookup_err;
+        err = lookup_err;
+        goto land;
     }
 
     /* lookup_err, if non-zero, must be ENOENT at this point */
@@ -1393,9 +1852,17 @@ out:
                 fuse_internal_forget_send(vnode_mount(dvp), context,
                                           nodeid, 1, &fdi);
             }
-            return err;
+            goto land;
         } else {
 
+            if (flight) {
+                /* Followers check the vnode type for themselves. */
+                flight->answer.node.vp  = *vpp;
+                flight->answer.node.vid = vnode_vid(*vpp);
+                fuse_internal_flight_land(fuse_get_mpdata(mp), flight, 0);
+                flight = NULL;
+            }
+
             if (!islastcn) {
 
                 int tmpvtype = vnode_vtype(*vpp);
@@ -1416,6 +1883,11 @@ out:
         fuse_ticket_drop(fdi.ticket);
     }
 
+land:
+    if (flight) {
+        fuse_internal_flight_land(fuse_get_mpdata(mp), flight, err);
+    }
+
     return err;
 }
 
@@ -2172,10 +2644,11 @@ fuse_vnop_readdir(struct vnop_readdir_args *ap)
 
     CHECK_BLANKET_DENIAL(vp, context, EPERM);
 
-    /* No cookies yet. */
-    if (flags & (VNODE_READDIR_REQSEEKOFF | VNODE_READDIR_EXTENDED)) {
-        return EINVAL;
-    }
+    /*
+     * The daemon's fuse_dirent.off cookies are used as seek offsets both for
+     * the uio and, with VNODE_READDIR_EXTENDED, for d_seekoff, so
+     * VNODE_READDIR_REQSEEKOFF can always be honoured.
+     */
 
     const user_ssize_t dirent_size = (user_ssize_t)sizeof(struct fuse_dirent);
     if ((uio_iovcnt(uio) > 1) || (uio_resid(uio) < dirent_size)) {
@@ -2204,7 +2677,7 @@ fuse_vnop_readdir(struct vnop_readdir_args *ap)
     size_t dircookedsize = FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET + MAXNAMLEN + 1);
     fiov_init(&cookediov, dircookedsize);
 
-    err = fuse_internal_readdir(vp, uio, context, fufh, &cookediov,
+    err = fuse_internal_readdir(vp, uio, flags, context, fufh, &cookediov,
                                 numdirentPtr);
 
     fiov_teardown(&cookediov);
@@ -2214,8 +2687,6 @@ fuse_vnop_readdir(struct vnop_readdir_args *ap)
         (void)fuse_filehandle_put(vp, context, FUFH_RDONLY);
     }
 
-    fuse_invalidate_attr(vp);
-
     return err;
 }
 
@@ -2236,11 +2707,13 @@ fuse_vnop_readlink(struct vnop_readlink_args *ap)
     vfs_context_t context = ap->a_context;
 
     struct fuse_dispatcher fdi;
-    int err;
-
-#ifdef FUSE4X_ENABLE_BIGLOCK
+    struct fuse_vnode_data *fvdat = VTOFUD(vp);
     struct fuse_data *data = fuse_get_mpdata(vnode_mount(vp));
-#endif
+    struct timespec uptsp;
+    char  *target = NULL; // private copy of the cached target
+    char  *answer;
+    size_t size = 0;
+    int err = 0;
 
     fuse_trace_printf_vnop();
 
@@ -2254,12 +2727,58 @@ fuse_vnop_readlink(struct vnop_readlink_args *ap)
         return EINVAL;
     }
 
-    if ((err = fuse_dispatcher_simple_putget_vp(&fdi, FUSE_READLINK, vp, context))) {
-        return err;
+    /*
+     * A symlink is never changed in place: replacing it yields a new nodeid
+     * or generation, hence a new vnode. So the target is kept for as long
+     * as the attributes it was read with.
+     */
+    nanouptime(&uptsp);
+
+    fuse_lck_mtx_lock(data->node_mtx);
+    if (fvdat->link_target &&
+        fuse_timespec_cmp(&uptsp, &fvdat->link_target_expires, <)) {
+        target = FUSE_OSMalloc(fvdat->link_target_size, fuse_malloc_tag);
+        if (target) {
+            size = fvdat->link_target_size;
+            memcpy(target, fvdat->link_target, size);
+        }
     }
+    fuse_lck_mtx_unlock(data->node_mtx);
 
-    if (((char *)fdi.answer)[0] == '/' &&
-        fuse_get_mpdata(vnode_mount(vp))->dataflags & FSESS_JAIL_SYMLINKS) {
+    if (target) {
+        answer = target;
+    } else {
+        if ((err = fuse_dispatcher_simple_putget_vp(&fdi, FUSE_READLINK, vp, context))) {
+            return err;
+        }
+        answer = fdi.answer;
+        size = fdi.iosize;
+
+        if (size > 0 && fuse_timespec_cmp(&uptsp, &fvdat->attr_valid, <)) {
+            char *copy = FUSE_OSMalloc(size, fuse_malloc_tag);
+            if (copy) {
+                char *old;
+                size_t oldsize;
+
+                memcpy(copy, answer, size);
+
+                fuse_lck_mtx_lock(data->node_mtx);
+                old = fvdat->link_target;
+                oldsize = fvdat->link_target_size;
+                fvdat->link_target = copy;
+                fvdat->link_target_size = size;
+                fvdat->link_target_expires = fvdat->attr_valid;
+                fuse_lck_mtx_unlock(data->node_mtx);
+
+                if (old) {
+                    FUSE_OSFree(old, oldsize, fuse_malloc_tag);
+                }
+            }
+        }
+    }
+
+    if (size > 0 && answer[0] == '/' &&
+        data->dataflags & FSESS_JAIL_SYMLINKS) {
             char *mpth = vfs_statfs(vnode_mount(vp))->f_mntonname;
             err = uiomove(mpth, (int)strlen(mpth), uio);
     }
@@ -2268,14 +2787,17 @@ fuse_vnop_readlink(struct vnop_readlink_args *ap)
 #ifdef FUSE4X_ENABLE_BIGLOCK
         fuse_biglock_unlock(data->biglock);
 #endif
-        err = uiomove(fdi.answer, (int)fdi.iosize, uio);
+        err = uiomove(answer, (int)size, uio);
 #ifdef FUSE4X_ENABLE_BIGLOCK
         fuse_biglock_lock(data->biglock);
 #endif
     }
 
-    fuse_ticket_drop(fdi.ticket);
-    fuse_invalidate_attr(vp);
+    if (target) {
+        FUSE_OSFree(target, size, fuse_malloc_tag);
+    } else {
+        fuse_ticket_drop(fdi.ticket);
+    }
 
     return err;
 }
@@ -2359,6 +2881,9 @@ out:
     fuse_vncache_purge(vp);
 
     fuse_lck_mtx_lock(data->node_mtx);
+    if (fvdat->prefetch_state == FN_PREFETCH_DONE) {
+        OSIncrementAtomic((SInt32 *)&fuse_attr_prefetch_wasted);
+    }
     RB_REMOVE(fuse_data_nodes, &data->nodes_head, fvdat);
     fuse_lck_mtx_unlock(data->node_mtx);
     vnode_removefsref(vp);
@@ -2488,6 +3013,7 @@ fuse_vnop_removexattr(struct vnop_removexattr_args *ap)
     ((char *)fdi.indata)[namelen] = '\0';
 
     err = fuse_dispatcher_wait_answer(&fdi);
+    fuse_xattrcache_purge(vp);
     if (!err) {
         fuse_ticket_drop(fdi.ticket);
         VTOFUD(vp)->c_flag |= C_TOUCH_CHGTIME;
@@ -2753,6 +3279,11 @@ fuse_vnop_setattr(struct vnop_setattr_args *ap)
         if (sizechanged) {
             fuse_invalidate_attr(vp);
         } else {
+            /* Mode, owner or flags may have changed who can do what. */
+            fuse_invalidate_access(vp);
+            if (fsai->valid & FATTR_MTIME) {
+                VTOFUD(vp)->flag &= ~FN_MTIME_DIRTY;
+            }
             cache_attrs(vp, (struct fuse_attr_out *)fdi.answer);
             if (fsai->valid & FATTR_BKUPTIME || fsai->valid & FATTR_CRTIME) {
                 VTOFUD(vp)->c_flag &= ~C_XTIMES_VALID;
@@ -2885,6 +3416,7 @@ fuse_vnop_setxattr(struct vnop_setxattr_args *ap)
 #endif
     if (!err) {
         err = fuse_dispatcher_wait_answer(&fdi);
+        fuse_xattrcache_purge(vp);
     }
 
     if (!err) {
@@ -2990,6 +3522,7 @@ fuse_vnop_symlink(struct vnop_symlink_args *ap)
 
     err = fuse_internal_newentry_core(dvp, vpp, cnp, VLNK, &fdi, context);
 
+    fuse_dircache_purge(dvp);
     if (err == 0) {
         fuse_invalidate_attr(dvp);
     }
@@ -3210,7 +3743,17 @@ fuse_vnop_write(struct vnop_write_args *ap)
             } else {
                 fvdat->filesize = original_size;
             }
-            fuse_invalidate_attr(vp);
+            if (fuse_iswritebackcache(vp)) {
+                /*
+                 * Nothing reached the daemon, so the attributes it gave us
+                 * are still good apart from the size and mtime we own.
+                 */
+                nanotime(&fvdat->modify_time);
+                VATTR_RETURN(VTOVA(vp), va_modify_time, fvdat->modify_time);
+                fvdat->flag |= FN_MTIME_DIRTY;
+            } else {
+                fuse_invalidate_attr(vp);
+            }
         }
 
         /*
@@ -3330,7 +3873,8 @@ fuse_vnop_ioctl(struct vnop_ioctl_args *ap)
 
 struct vnodeopv_entry_desc fuse_vnode_operation_entries[] = {
     { &vnop_access_desc,        (fuse_vnode_op_t) fuse_vnop_access        },
-    { &vnop_allocate_desc,      (fuse_vnode_op_t) nop_allocate            }, // vnop stub until FUSE_FALLOCATE is implemented
+    { &vnop_advlock_desc,       (fuse_vnode_op_t) fuse_vnop_advlock       },
+    { &vnop_allocate_desc,      (fuse_vnode_op_t) fuse_vnop_allocate      },
     { &vnop_blktooff_desc,      (fuse_vnode_op_t) fuse_vnop_blktooff      },
     { &vnop_blockmap_desc,      (fuse_vnode_op_t) fuse_vnop_blockmap      },
     { &vnop_close_desc,         (fuse_vnode_op_t) fuse_vnop_close         },
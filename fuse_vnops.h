@@ -16,9 +16,9 @@ typedef int (*fuse_vnode_op_t)(void *);
 
 FUSE_VNOP_EXPORT int fuse_vnop_access(struct vnop_access_args *ap);
 
-// FUSE_VNOP_EXPORT int fuse_vnop_advlock(struct vnop_advlock_args *ap);
+FUSE_VNOP_EXPORT int fuse_vnop_advlock(struct vnop_advlock_args *ap);
 
-// FUSE_VNOP_EXPORT int fuse_vnop_allocate(struct vnop_allocate_args *ap);
+FUSE_VNOP_EXPORT int fuse_vnop_allocate(struct vnop_allocate_args *ap);
 
 FUSE_VNOP_EXPORT int fuse_vnop_blktooff(struct vnop_blktooff_args *ap);
 